@@ -42,19 +42,19 @@
 
 // GPIO (rtc_gpio_hold_en())
 #include "driver/rtc_io.h"
-
-// MicroSD
-#include "driver/sdmmc_host.h"
-#include "driver/sdmmc_defs.h"
-#include "sdmmc_cmd.h"
-#include "esp_vfs_fat.h"
-#include <dirent.h>
+// RTC slow clock calibration (rtc_clk_cal())
+#include "soc/rtc.h"
 
 #include "io_defs.h"
 #include "camera.h"
 #include "configuration.h"
+#include "avi.h"
+#include "change.h"
 #include "exif.h"
+#include "pipeline.h"
+#include "schedule.h"
 #include "setup_mode.h"
+#include "storage.h"
 
 #define ARRAY_SIZE(a) (sizeof(a)/sizeof((a)[0]))
 
@@ -64,26 +64,55 @@
 
 // Minimum sleep time.
 // If next capture is less then this many micro seconds away, then stay awake.
-// FIXME: This can probably be reduced if WITH_EVIL_CAM_PWR_SHUTDOWN is
-//        disabled, test this.
-#define MIN_SLEEP_TIME (15 * SEC_AS_USEC)
+// The actual threshold is the maximum of this value and the current wake-up
+// lead time, since sleeping shorter than it takes to wake-up is pointless.
+#ifdef WITH_EVIL_CAM_PWR_SHUTDOWN
+# define MIN_SLEEP_TIME (15 * SEC_AS_USEC)
+#else // WITH_EVIL_CAM_PWR_SHUTDOWN
+# define MIN_SLEEP_TIME (1 * SEC_AS_USEC)
+#endif // WITH_EVIL_CAM_PWR_SHUTDOWN
 // Wake-up this many micro seconds before capture time to allow initialization.
+// Only used until the wake-up latency has been measured.
 #define WAKE_USEC_EARLY (6 * SEC_AS_USEC)
+// Bounds for the measured wake-up lead time
+#define WAKE_USEC_EARLY_MIN (500 * MSEC_AS_USEC)
+#define WAKE_USEC_EARLY_MAX (10 * SEC_AS_USEC)
+// Wake-up latency samples above this are not caused by the wake-up itself,
+// i.e. by a clock step, and are ignored
+#define WAKE_LATENCY_MAX (60 * SEC_AS_USEC)
+
+// Minimum time to next capture to use light sleep, if deep sleep is not
+// possible.
+#define LIGHT_SLEEP_MIN_TIME (200 * MSEC_AS_USEC)
+// Wake-up from light sleep this many micro seconds before capture time to
+// allow the camera to leave standby.
+#define LIGHT_WAKE_USEC_EARLY (100 * MSEC_AS_USEC)
+
+// Amount of RTC slow clock cycles to measure against the main XTAL when
+// calibrating the slow clock. Takes about 7 ms with the internal 150 kHz RC
+// oscillator.
+#define SLOW_CLK_CAL_CYCLES 1024
 
-// Timelapse directory name format: /sdcard/timelapseXXXX/
-#define CAPTURE_DIR_PREFIX "timelapse"
-#define CAPTURE_DIR_PREFIX_LEN 9
 
 // RTC memory storage
 RTC_DATA_ATTR struct {
 	struct timeval next_capture_time;
+	struct timeval wake_time; // Time the wake-up timer was set to expire
+	bool wake_latency_valid;
+	uint32_t wake_latency_avg; // Smoothed wake-up to capture ready time, usec.
+	uint32_t wake_latency_dev; // Smoothed mean deviation of the above, usec.
+	struct timeval sleep_start; // Time deep sleep was entered
+	uint64_t sleep_rtc_ticks; // RTC slow clock counter at sleep_start
+	uint32_t sleep_slow_clk_cal; // Slow clock period at sleep_start, see rtc_clk_cal()
+	int32_t slow_clk_drift_ppm; // Slow clock period change during last sleep
 } nv_data;
 
 // Globals
 static bool setup_mode = false;
-static char capture_path[8 + CAPTURE_DIR_PREFIX_LEN + 4 + 1];
-static struct timeval capture_interval_tv;
 static struct timeval next_capture_time;
+#ifdef WITH_SLEEP
+static bool sleep_tier_logged = false;
+#endif // WITH_SLEEP
 
 /************************ Initialization ************************/
 void setup()
@@ -98,6 +127,12 @@ void setup()
   Serial.println();
   print_capability();
 
+#ifdef WITH_SLEEP
+  if (is_wakeup) {
+    correct_sleep_drift();
+  }
+#endif // WITH_SLEEP
+
   // Configure red LED
   pinMode(LED_GPIO_NUM, OUTPUT);
   digitalWrite(LED_GPIO_NUM, HIGH);
@@ -117,7 +152,7 @@ void setup()
   }
 
   // Init SD Card
-  if (!init_sdcard()) {
+  if (!storage_init()) {
     goto fail;
   }
 
@@ -143,8 +178,6 @@ void setup()
     }
   }
   update_exif_from_cfg(cfg);
-  capture_interval_tv.tv_sec = cfg.getCaptureInterval() / 1000;
-  capture_interval_tv.tv_usec = (cfg.getCaptureInterval() % 1000) * 1000;
 
   // Set timezone
   setenv("TZ", cfg.getTzInfo(), 1);
@@ -169,6 +202,7 @@ void setup()
     Serial.println();
   } else {
     (void) gettimeofday(&next_capture_time, NULL);
+    schedule_adjust(&next_capture_time);
   }
 
   if (setup_mode) {
@@ -178,9 +212,15 @@ void setup()
     }
   } else {
     // Initialize capture directory
-    if (!init_capture_dir(is_wakeup)) {
+    if (!storage_init_capture_dir(is_wakeup)) {
       goto fail;
     }
+
+    if (cfg.getOutputFormat() == Configuration::OutputFormatAvi) {
+      if (!avi_open(storage_get_capture_path())) {
+        goto fail;
+      }
+    }
   }
 
   // camera init
@@ -188,6 +228,18 @@ void setup()
     goto fail;
   }
 
+  if (!setup_mode && cfg.getPipeline()) {
+    if (!pipeline_init(write_photo)) {
+      goto fail;
+    }
+  }
+
+#ifdef WITH_SLEEP
+  if (is_wakeup && !setup_mode) {
+    update_wake_latency();
+  }
+#endif // WITH_SLEEP
+
   if (setup_mode) {
     Serial.println("--- Initialization Done, Entering Setup Mode ---");
   } else {
@@ -213,171 +265,242 @@ fail:
   }
 }
 
+#ifdef WITH_SLEEP
 /**
- * Mount SD Card
+ * Convert RTC slow clock ticks to micro seconds
+ *
+ * @param cal	Slow clock period, as returned by rtc_clk_cal()
  */
-static bool init_sdcard()
+static uint64_t rtc_ticks_to_usec(uint64_t ticks, uint32_t cal)
 {
-  esp_err_t ret = ESP_FAIL;
-  sdmmc_host_t host = SDMMC_HOST_DEFAULT();
-  sdmmc_slot_config_t slot_config = SDMMC_SLOT_CONFIG_DEFAULT();
-  esp_vfs_fat_sdmmc_mount_config_t mount_config = {
-    .format_if_mount_failed = false,
-    .max_files = 1,
-  };
-  sdmmc_card_t *card;
+  // Split multiplication to prevent overflow on long sleeps
+  const uint64_t fract_mask = (1ULL << RTC_CLK_CAL_FRACT) - 1;
+  return (ticks >> RTC_CLK_CAL_FRACT) * cal +
+         (((ticks & fract_mask) * cal) >> RTC_CLK_CAL_FRACT);
+}
 
-#ifdef WITH_SD_4BIT
-  host.flags = SDMMC_HOST_FLAG_4BIT;
-  slot_config.width = 4;
-#else
-  host.flags = SDMMC_HOST_FLAG_1BIT;
-  slot_config.width = 1;
-#endif
+/**
+ * Save state needed by correct_sleep_drift(), right before deep sleep
+ */
+static void save_sleep_start()
+{
+  nv_data.sleep_slow_clk_cal = rtc_clk_cal(RTC_CAL_RTC_MUX,
+                                           SLOW_CLK_CAL_CYCLES);
+  nv_data.sleep_rtc_ticks = rtc_time_get();
+  (void) gettimeofday(&nv_data.sleep_start, NULL);
+}
+
+/**
+ * Correct system time for RTC slow clock drift during deep sleep
+ *
+ * In deep sleep the time is kept by the RTC slow clock, a RC oscillator whose
+ * frequency changes with temperature. The slow clock is calibrated against the
+ * main XTAL before sleeping and after waking up. The sleep duration is then
+ * calculated using the average slow clock period of both calibrations, instead
+ * of a single calibration value.
+ */
+static void correct_sleep_drift()
+{
+  uint32_t cal = rtc_clk_cal(RTC_CAL_RTC_MUX, SLOW_CLK_CAL_CYCLES);
+  uint64_t ticks = rtc_time_get();
+  struct timeval now;
+  (void) gettimeofday(&now, NULL);
 
-  Serial.print("Mounting SD card... ");
-  ret = esp_vfs_fat_sdmmc_mount("/sdcard", &host, &slot_config, &mount_config,
-                                &card);
-  if (ret == ESP_OK) {
-    Serial.println("Done");
-  }  else  {
-    Serial.println("FAILED");
-    Serial.printf("Failed to mount SD card VFAT filesystem. Error: %s\n",
-                     esp_err_to_name(ret));
-    return false;
+  if (nv_data.sleep_slow_clk_cal == 0 || cal == 0 ||
+      ticks < nv_data.sleep_rtc_ticks) {
+    Serial.println("No slow clock calibration from before sleep");
+    return;
   }
 
-  return true;
+  nv_data.slow_clk_drift_ppm =
+      ((int64_t) cal - (int64_t) nv_data.sleep_slow_clk_cal) * 1000000 /
+      (int64_t) nv_data.sleep_slow_clk_cal;
+
+  uint64_t slept = rtc_ticks_to_usec(ticks - nv_data.sleep_rtc_ticks,
+      ((uint64_t) nv_data.sleep_slow_clk_cal + cal) / 2);
+  struct timeval slept_tv = {
+    (time_t) (slept / SEC_AS_USEC),
+    (suseconds_t) (slept % SEC_AS_USEC)
+  };
+  struct timeval expected;
+  timeradd(&nv_data.sleep_start, &slept_tv, &expected);
+
+  struct timeval error_tv;
+  int64_t error;
+  timersub(&now, &expected, &error_tv);
+  error = (int64_t) error_tv.tv_sec * SEC_AS_USEC + error_tv.tv_usec;
+
+  Serial.printf("Slow clock drift: %d ppm, time corrected by %lld ms\n",
+                nv_data.slow_clk_drift_ppm, -error / 1000);
+
+  if (error != 0) {
+    (void) settimeofday(&expected, NULL);
+  }
 }
 
 /**
- * Create new directory to store images
+ * Update wake-up latency estimate
+ *
+ * Measures the time between the wake-up timer expiring and the camera being
+ * ready to capture. The estimate is a moving average plus mean deviation,
+ * similar to the TCP round trip time estimator.
  */
-static bool init_capture_dir(bool reuse_last_dir)
+static void update_wake_latency()
 {
-  DIR *dirp;
-  struct dirent *dp;
-  int dir_idx = 0;
-
-  // Find unused directory name
-  if ((dirp = opendir("/sdcard/")) == NULL) {
-    Serial.println("couldn't open directory /sdcard/");
-    return -1;
+  struct timeval now;
+  struct timeval latency_tv;
+  uint64_t latency64 = 0;
+
+  (void) gettimeofday(&now, NULL);
+  if (timercmp(&now, &nv_data.wake_time, >)) {
+    timersub(&now, &nv_data.wake_time, &latency_tv);
+    latency64 = (uint64_t) latency_tv.tv_sec * SEC_AS_USEC +
+                latency_tv.tv_usec;
+  }
+  if (latency64 > WAKE_LATENCY_MAX) {
+    Serial.printf("Wake-up latency: %llu ms, ignored\n", latency64 / 1000);
+    return;
   }
+  uint32_t latency = latency64;
 
-  do {
-    errno = 0;
-    if ((dp = readdir(dirp)) != NULL) {
-      if (strlen(dp->d_name) != CAPTURE_DIR_PREFIX_LEN + 4)
-        continue;
-      if (strncmp(dp->d_name, CAPTURE_DIR_PREFIX,
-          CAPTURE_DIR_PREFIX_LEN) != 0)
-        continue;
-
-      char *endp;
-      int idx = strtoul(&(dp->d_name[CAPTURE_DIR_PREFIX_LEN]), &endp, 10);
-      if (*endp != '\0')
-        continue;
-
-      if (idx > dir_idx) {
-        dir_idx = idx;
-      }
-    }
-  } while (dp != NULL);
+  if (!nv_data.wake_latency_valid) {
+    nv_data.wake_latency_avg = latency;
+    nv_data.wake_latency_dev = latency / 2;
+    nv_data.wake_latency_valid = true;
+  } else {
+    int32_t err = (int32_t) latency - (int32_t) nv_data.wake_latency_avg;
+    nv_data.wake_latency_avg += err / 8;
+    nv_data.wake_latency_dev += ((int32_t) abs(err) -
+                                 (int32_t) nv_data.wake_latency_dev) / 4;
+  }
 
-  (void) closedir(dirp);
+  Serial.printf("Wake-up latency: %u ms, average: %u ms, deviation: %u ms\n",
+                latency / 1000,
+                nv_data.wake_latency_avg / 1000,
+                nv_data.wake_latency_dev / 1000);
+}
 
-  if (errno != 0) {
-    Serial.println("Error reading directory /sdcard/");
-    return false;
+/**
+ * Get time to wake-up before the next capture
+ */
+static uint64_t get_wake_lead_time()
+{
+  if (!nv_data.wake_latency_valid) {
+    return WAKE_USEC_EARLY;
   }
 
-  if (!reuse_last_dir) {
-    dir_idx += 1;
+  uint64_t lead_time = (uint64_t) nv_data.wake_latency_avg +
+                       4 * (uint64_t) nv_data.wake_latency_dev;
+  if (lead_time < WAKE_USEC_EARLY_MIN) {
+    lead_time = WAKE_USEC_EARLY_MIN;
+  } else if (lead_time > WAKE_USEC_EARLY_MAX) {
+    lead_time = WAKE_USEC_EARLY_MAX;
   }
 
-  // Create new dir
-  snprintf(capture_path, sizeof(capture_path),
-	"/sdcard/" CAPTURE_DIR_PREFIX "%04u", dir_idx);
-  
-  if (!reuse_last_dir) {
-    if (mkdir(capture_path, 0644) != 0) {
-      Serial.print("Failed to create directory: ");
-      Serial.println(capture_path);
-      return false;
+  return lead_time;
+}
+#endif // WITH_SLEEP
+
+/************************ Main ************************/
+
+/**
+ * Write picture to SD card
+ *
+ * Takes ownership of the frame buffer. Called directly from save_photo(), or
+ * from the writer task if the capture pipeline is enabled.
+ */
+static void write_photo(camera_fb_t *fb, const struct timeval *tv)
+{
+  unsigned long start = micros();
+
+  // Generate Exif header
+  const uint8_t *exif_header = NULL;
+  size_t exif_len = 0;
+  get_exif_header(fb, tv, &exif_header, &exif_len);
+
+  size_t data_offset = get_jpeg_data_offset(fb);
+  if (exif_header == NULL) {
+    exif_len = 0;
+    data_offset = 0;
+  }
+
+  // Save picture
+  storage_reserve(exif_len + fb->len - data_offset);
+  if (cfg.getOutputFormat() == Configuration::OutputFormatAvi) {
+    if (avi_add_frame(exif_header, exif_len,
+                      &fb->buf[data_offset], fb->len - data_offset,
+                      fb->width, fb->height)) {
+      Serial.printf("Appended to %s", avi_get_path());
+      Serial.println();
+    } else {
+      Serial.println("Failed\nError while writing to AVI file");
     }
+  } else {
+    storage_write_jpeg(tv, exif_header, exif_len,
+                       &fb->buf[data_offset], fb->len - data_offset);
   }
 
-  Serial.print("Storing pictures in: ");
-  Serial.println(capture_path);
+  camera_fb_return(fb);
 
-  return true;
-}
+  pipeline_stats_write(micros() - start);
 
-/************************ Main ************************/
+  if (cfg.getEnableBusyLed()) {
+    digitalWrite(LED_GPIO_NUM, HIGH);
+  }
+}
 
 /**
  * Take picture and save to SD card
  */
 static void save_photo()
 {
-  camera_fb_t *fb;
+  camera_fb_t *fb = NULL;
+  unsigned int count = 1;
 
   if (cfg.getEnableBusyLed()) {
     digitalWrite(LED_GPIO_NUM, LOW);
   }
 
-  // Capture image
-  fb = camera_capture();
+  // Skip capture if the scene didn't change
+  if (!change_detect()) {
+    if (cfg.getEnableBusyLed()) {
+      digitalWrite(LED_GPIO_NUM, HIGH);
+    }
+    return;
+  }
 
-  // Generate filename
-  time_t now = time(NULL);
-  struct tm timeinfo;
-  localtime_r(&now, &timeinfo);
+  // In burst mode 'all' every image of the burst is saved
+  if (cfg.getBurstSelect() == Configuration::BurstSelectAll) {
+    count = cfg.getBurstCount();
+  }
 
-  char filename[sizeof(capture_path) + 15 + 4 + 1];
-  size_t capture_path_len = strlen(capture_path);
-  strcpy(filename, capture_path);
-  strftime(&filename[capture_path_len], sizeof(filename) - capture_path_len,
-             "/%Y%m%d_%H%M%S.jpg", &timeinfo);
+  for (unsigned int i = 0; i < count; i++) {
+    // Capture image
+    unsigned long start = micros();
+    fb = camera_capture(i == 0);
+    pipeline_stats_capture(micros() - start);
 
-  // Generate Exif header
-  const uint8_t *exif_header = NULL;
-  size_t exif_len = 0;
-  get_exif_header(fb, &exif_header, &exif_len);
+    if (fb == NULL) {
+      Serial.println("Failed\nCamera capture failed");
+      break;
+    }
 
-  size_t data_offset = get_jpeg_data_offset(fb);
+    struct timeval tv;
+    (void) gettimeofday(&tv, NULL);
 
-  // Save picture
-  FILE *file = fopen(filename, "w");
-  if (file != NULL)  {
-    size_t ret = 0;
-    if (exif_header != NULL) {
-      ret = fwrite(exif_header, exif_len, 1, file);
-      if (ret != 1) {
-        Serial.println("Failed\nError while writing header to file");
-        data_offset = 0;
+    if (cfg.getPipeline()) {
+      if (!pipeline_submit(fb, &tv)) {
+        Serial.println("Failed\nUnable to queue image for writing");
+        camera_fb_return(fb);
       }
     } else {
-        data_offset = 0;
-    }
-
-    ret = fwrite(&fb->buf[data_offset], fb->len - data_offset, 1, file);
-    if (ret != 1) {
-      Serial.println("Failed\nError while writing to file");
-    } else {
-      Serial.printf("Saved as %s", filename);
-      Serial.println();
+      write_photo(fb, &tv);
     }
-    fclose(file);
-  } else {
-    Serial.printf("Failed\nCould not open file: %s", filename);
-    Serial.println();
   }
 
-  camera_fb_return(fb);
-  
-  if (cfg.getEnableBusyLed()) {
+  // The burst stops at the first failed capture, else write_photo() turned
+  // off the LED after writing the last frame
+  if (fb == NULL && cfg.getEnableBusyLed()) {
     digitalWrite(LED_GPIO_NUM, HIGH);
   }
 }
@@ -390,14 +513,34 @@ void loop()
   }
 
   // Take picture if interval passed
-  // NOTE: This breaks if clock jumps are introduced. Make sure to use
-  // adjtime().
+  // If capture times were missed, i.e. because a capture took longer than the
+  // interval or the clock jumped, the missed_capture option determines if
+  // they are caught up.
   struct timeval now;
   (void) gettimeofday(&now, NULL);
   if (!timercmp(&now, &next_capture_time, <)) {
-    save_photo();
+    Configuration::MissedCapture missed_capture = cfg.getMissedCapture();
+    struct timeval following = next_capture_time;
+    schedule_next(&following);
+    bool missed = !timercmp(&now, &following, <);
+
+    // Not active when only waking up to check for new schedule rules
+    if (schedule_active(&next_capture_time) &&
+        !(missed && missed_capture == Configuration::MissedCaptureSkip)) {
+      save_photo();
+    }
+#ifdef WITH_SLEEP
+    sleep_tier_logged = false;
+#endif // WITH_SLEEP
 
-    timeradd(&next_capture_time, &capture_interval_tv, &next_capture_time);
+    (void) gettimeofday(&now, NULL);
+    if (missed_capture != Configuration::MissedCaptureCatchUp &&
+        !timercmp(&now, &following, <)) {
+      schedule_skip(&following, &now);
+      Serial.printf("Missed capture time, next capture at: %s",
+                    ctime(&following.tv_sec));
+    }
+    next_capture_time = following;
   }
 
   // Sleep till next capture time
@@ -407,23 +550,33 @@ void loop()
   if (timercmp(&now, &next_capture_time, <)) {
     timersub(&next_capture_time, &now, &time_to_next_capture);
 
-    uint64_t sleep_time =  ((uint64_t) time_to_next_capture.tv_sec) *
-                            SEC_AS_USEC + time_to_next_capture.tv_usec;
+    uint64_t capture_wait =  ((uint64_t) time_to_next_capture.tv_sec) *
+                              SEC_AS_USEC + time_to_next_capture.tv_usec;
+    Configuration::SleepMode sleep_mode = cfg.getSleepMode();
 
     // Wake earlier to allow initialization
-    if (sleep_time > WAKE_USEC_EARLY) {
-      sleep_time -= WAKE_USEC_EARLY;
-    } else {
-      sleep_time = 0;
+    uint64_t lead_time = get_wake_lead_time();
+    uint64_t sleep_time = 0;
+    if (capture_wait > lead_time) {
+      sleep_time = capture_wait - lead_time;
     }
 
-    if (sleep_time >= MIN_SLEEP_TIME) {
-      Serial.printf("Sleeping for %llu us\n", sleep_time);
+    uint64_t min_sleep_time = lead_time;
+    if (min_sleep_time < MIN_SLEEP_TIME) {
+      min_sleep_time = MIN_SLEEP_TIME;
+    }
+
+    if ((sleep_mode == Configuration::SleepModeAuto ||
+         sleep_mode == Configuration::SleepModeDeep) &&
+        sleep_time >= min_sleep_time) {
+      Serial.printf("Sleep tier: deep, sleeping for %llu us, waking %llu ms early\n",
+                    sleep_time, lead_time / 1000);
       Serial.flush();
 
       // Preserve non-volatile data
       nv_data.next_capture_time = next_capture_time;
 
+      pipeline_flush();
       camera_deinit();
 
       // Lock pin states (need to be unlocked at init again)
@@ -435,10 +588,49 @@ void loop()
       rtc_gpio_hold_en(gpio_num_t(PWDN_GPIO_NUM)); //TODO: is this needed???
 #endif // PWDN_GPIO_NUM >= 0
 
+      // Writing pending frames may have taken a while. Calculate the sleep
+      // time from the time sleep starts, so it isn't counted as wake-up
+      // latency.
+      save_sleep_start();
+      sleep_time = 0;
+      if (timercmp(&nv_data.sleep_start, &next_capture_time, <)) {
+        timersub(&next_capture_time, &nv_data.sleep_start,
+                 &time_to_next_capture);
+        capture_wait = ((uint64_t) time_to_next_capture.tv_sec) *
+                       SEC_AS_USEC + time_to_next_capture.tv_usec;
+        if (capture_wait > lead_time) {
+          sleep_time = capture_wait - lead_time;
+        }
+      }
+      struct timeval sleep_tv = {
+        (time_t) (sleep_time / SEC_AS_USEC),
+        (suseconds_t) (sleep_time % SEC_AS_USEC)
+      };
+      timeradd(&nv_data.sleep_start, &sleep_tv, &nv_data.wake_time);
+
       esp_sleep_enable_timer_wakeup(sleep_time);
       esp_deep_sleep_start();
       // This line will never be reached....
+    } else if ((sleep_mode == Configuration::SleepModeAuto ||
+                sleep_mode == Configuration::SleepModeLight) &&
+               capture_wait >= LIGHT_SLEEP_MIN_TIME) {
+      sleep_time = capture_wait - LIGHT_WAKE_USEC_EARLY;
+
+      Serial.printf("Sleep tier: light, sleeping for %llu us\n", sleep_time);
+      Serial.flush();
+
+      pipeline_flush();
+      camera_standby(true);
+
+      esp_sleep_enable_timer_wakeup(sleep_time);
+      esp_light_sleep_start();
+
+      camera_standby(false);
+    } else if (!sleep_tier_logged) {
+      Serial.printf("Sleep tier: awake, next capture in %llu ms\n",
+                    capture_wait / 1000);
     }
+    sleep_tier_logged = true;
   }
 #endif // WITH_SLEEP
 }
@@ -0,0 +1,498 @@
+/**
+ * avi.cpp - Append images to a MJPEG AVI file
+ *
+ * Copyright (c) 2019, David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+
+#include "Arduino.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "esp_heap_caps.h"
+
+#include "avi.h"
+#include "configuration.h"
+#include "storage.h"
+
+// Maximum size of the movi list. Files are kept below 1 GiB for
+// compatibility with AVI 1.0 readers.
+#define AVI_MAX_MOVI_SIZE (1000UL * 1024 * 1024)
+
+// Maximum length of AVI file path
+#define AVI_PATH_MAX 64
+
+// AVI file name format, relative to directory
+#define AVI_FILE_FORMAT "/video%03u.avi"
+
+// Step in which the file is grown if the prealloc option is set. Large
+// steps keep the cluster chain contiguous and avoid allocating clusters while
+// appending frames.
+#define AVI_PREALLOC_STEP (16UL * 1024 * 1024)
+
+// Amount of idx1 entries to write at once when finalizing, if the whole index
+// doesn't fit in PSRAM
+#define AVI_IDX_BATCH 64
+
+#define FOURCC(a, b, c, d) \
+  ((uint32_t) (a) | (uint32_t) (b) << 8 | \
+   (uint32_t) (c) << 16 | (uint32_t) (d) << 24)
+
+// AVI header flags
+#define AVIF_HASINDEX 0x00000010
+#define AVIIF_KEYFRAME 0x00000010
+
+/**
+ * AVI file header
+ *
+ * All headers before the movi data. The layout is completely static, and
+ * written as a whole every time a frame is appended.
+ */
+#pragma pack(1)
+struct AviHeader {
+  uint32_t riff; // 'RIFF'
+  uint32_t riff_size;
+  uint32_t avi; // 'AVI '
+  uint32_t hdrl_list; // 'LIST'
+  uint32_t hdrl_size;
+  uint32_t hdrl; // 'hdrl'
+  uint32_t avih; // 'avih'
+  uint32_t avih_size;
+  struct {
+    uint32_t micro_sec_per_frame;
+    uint32_t max_bytes_per_sec;
+    uint32_t padding_granularity;
+    uint32_t flags;
+    uint32_t total_frames;
+    uint32_t initial_frames;
+    uint32_t streams;
+    uint32_t suggested_buffer_size;
+    uint32_t width;
+    uint32_t height;
+    uint32_t reserved[4];
+  } main_header;
+  uint32_t strl_list; // 'LIST'
+  uint32_t strl_size;
+  uint32_t strl; // 'strl'
+  uint32_t strh; // 'strh'
+  uint32_t strh_size;
+  struct {
+    uint32_t type;
+    uint32_t handler;
+    uint32_t flags;
+    uint16_t priority;
+    uint16_t language;
+    uint32_t initial_frames;
+    uint32_t scale;
+    uint32_t rate;
+    uint32_t start;
+    uint32_t length;
+    uint32_t suggested_buffer_size;
+    uint32_t quality;
+    uint32_t sample_size;
+    struct {
+      int16_t left;
+      int16_t top;
+      int16_t right;
+      int16_t bottom;
+    } frame;
+  } stream_header;
+  uint32_t strf; // 'strf'
+  uint32_t strf_size;
+  struct {
+    uint32_t size;
+    int32_t width;
+    int32_t height;
+    uint16_t planes;
+    uint16_t bit_count;
+    uint32_t compression;
+    uint32_t size_image;
+    int32_t x_pels_per_meter;
+    int32_t y_pels_per_meter;
+    uint32_t clr_used;
+    uint32_t clr_important;
+  } bitmap_info;
+  uint32_t movi_list; // 'LIST'
+  uint32_t movi_size;
+  uint32_t movi; // 'movi'
+};
+#pragma pack()
+
+#pragma pack(1)
+struct AviChunkHeader {
+  uint32_t id;
+  uint32_t size;
+};
+#pragma pack()
+
+#pragma pack(1)
+struct AviIndexEntry {
+  uint32_t id;
+  uint32_t flags;
+  uint32_t offset; // Offset of chunk from 'movi' FOURCC
+  uint32_t size;
+};
+#pragma pack()
+
+// Offset of the 'movi' FOURCC, used as base for idx1 offsets
+#define AVI_MOVI_OFFSET (offsetof(AviHeader, movi))
+
+/**
+ * AVI writer state
+ *
+ * Stored in RTC memory so appending can continue after deep sleep.
+ */
+RTC_DATA_ATTR static struct {
+  bool valid;
+  bool finalized; // Next frame should start a new file
+  char dir[AVI_PATH_MAX];
+  unsigned int file_idx;
+  uint32_t frames;
+  uint32_t movi_size; // Bytes in movi list, including 'movi' FOURCC
+  uint32_t max_frame_size;
+  uint16_t width;
+  uint16_t height;
+  uint32_t alloc_size; // Pre-allocated file size
+} avi_state;
+
+static char avi_path[AVI_PATH_MAX + sizeof(AVI_FILE_FORMAT)];
+
+static void avi_update_path()
+{
+  snprintf(avi_path, sizeof(avi_path), "%s" AVI_FILE_FORMAT,
+           avi_state.dir, avi_state.file_idx);
+}
+
+static void avi_fill_header(AviHeader *hdr, bool has_index)
+{
+  uint32_t fps = AVI_FRAME_RATE;
+
+  memset(hdr, 0, sizeof(*hdr));
+
+  hdr->riff = FOURCC('R', 'I', 'F', 'F');
+  hdr->riff_size = sizeof(AviHeader) - offsetof(AviHeader, avi) +
+                   avi_state.movi_size - sizeof(hdr->movi);
+  hdr->avi = FOURCC('A', 'V', 'I', ' ');
+
+  hdr->hdrl_list = FOURCC('L', 'I', 'S', 'T');
+  hdr->hdrl_size = offsetof(AviHeader, movi_list) - offsetof(AviHeader, hdrl);
+  hdr->hdrl = FOURCC('h', 'd', 'r', 'l');
+
+  hdr->avih = FOURCC('a', 'v', 'i', 'h');
+  hdr->avih_size = sizeof(hdr->main_header);
+  hdr->main_header.micro_sec_per_frame = 1000000 / fps;
+  hdr->main_header.max_bytes_per_sec = avi_state.max_frame_size * fps;
+  hdr->main_header.flags = has_index ? AVIF_HASINDEX : 0;
+  hdr->main_header.total_frames = avi_state.frames;
+  hdr->main_header.streams = 1;
+  hdr->main_header.suggested_buffer_size = avi_state.max_frame_size;
+  hdr->main_header.width = avi_state.width;
+  hdr->main_header.height = avi_state.height;
+
+  hdr->strl_list = FOURCC('L', 'I', 'S', 'T');
+  hdr->strl_size = offsetof(AviHeader, movi_list) - offsetof(AviHeader, strl);
+  hdr->strl = FOURCC('s', 't', 'r', 'l');
+
+  hdr->strh = FOURCC('s', 't', 'r', 'h');
+  hdr->strh_size = sizeof(hdr->stream_header);
+  hdr->stream_header.type = FOURCC('v', 'i', 'd', 's');
+  hdr->stream_header.handler = FOURCC('M', 'J', 'P', 'G');
+  hdr->stream_header.scale = 1;
+  hdr->stream_header.rate = fps;
+  hdr->stream_header.length = avi_state.frames;
+  hdr->stream_header.suggested_buffer_size = avi_state.max_frame_size;
+  hdr->stream_header.quality = 0xffffffff;
+  hdr->stream_header.frame.right = avi_state.width;
+  hdr->stream_header.frame.bottom = avi_state.height;
+
+  hdr->strf = FOURCC('s', 't', 'r', 'f');
+  hdr->strf_size = sizeof(hdr->bitmap_info);
+  hdr->bitmap_info.size = sizeof(hdr->bitmap_info);
+  hdr->bitmap_info.width = avi_state.width;
+  hdr->bitmap_info.height = avi_state.height;
+  hdr->bitmap_info.planes = 1;
+  hdr->bitmap_info.bit_count = 24;
+  hdr->bitmap_info.compression = FOURCC('M', 'J', 'P', 'G');
+  hdr->bitmap_info.size_image = avi_state.width * avi_state.height * 3;
+
+  hdr->movi_list = FOURCC('L', 'I', 'S', 'T');
+  hdr->movi_size = avi_state.movi_size;
+  hdr->movi = FOURCC('m', 'o', 'v', 'i');
+}
+
+/**
+ * Start a new AVI file, with the first free file index
+ */
+static bool avi_create(uint16_t width, uint16_t height)
+{
+  struct stat st;
+
+  avi_update_path();
+  while (stat(avi_path, &st) == 0) {
+    avi_state.file_idx++;
+    avi_update_path();
+  }
+
+  avi_state.finalized = false;
+  avi_state.frames = 0;
+  avi_state.movi_size = sizeof(((AviHeader *) 0)->movi);
+  avi_state.max_frame_size = 0;
+  avi_state.width = width;
+  avi_state.height = height;
+  avi_state.alloc_size = 0;
+
+  AviHeader hdr;
+  avi_fill_header(&hdr, false);
+
+  FILE *file = fopen(avi_path, "w");
+  if (file == NULL) {
+    Serial.printf("Could not create AVI file: %s\n", avi_path);
+    return false;
+  }
+  size_t ret = fwrite(&hdr, sizeof(hdr), 1, file);
+  fclose(file);
+  if (ret != 1) {
+    Serial.printf("Error while writing AVI header to %s\n", avi_path);
+    return false;
+  }
+
+  Serial.printf("Started AVI file: %s\n", avi_path);
+
+  return true;
+}
+
+bool avi_open(const char *dir)
+{
+  if (strlen(dir) >= sizeof(avi_state.dir)) {
+    Serial.println("AVI directory path too long");
+    return false;
+  }
+
+  if (avi_state.valid && strcmp(avi_state.dir, dir) == 0) {
+    avi_update_path();
+    Serial.printf("Continuing AVI file: %s, %u frames\n",
+                  avi_path, avi_state.frames);
+    return true;
+  }
+
+  // Close the file of the previous directory, so it gets its index
+  if (avi_state.valid && !avi_state.finalized) {
+    avi_update_path();
+    avi_finalize();
+  }
+
+  memset(&avi_state, 0, sizeof(avi_state));
+  strcpy(avi_state.dir, dir);
+  avi_state.finalized = true;
+  avi_state.file_idx = 0;
+  avi_state.valid = true;
+
+  return true;
+}
+
+bool avi_add_frame(const uint8_t *hdr, size_t hdr_len,
+                   const uint8_t *data, size_t data_len,
+                   uint16_t width, uint16_t height)
+{
+  AviChunkHeader chunk;
+  chunk.id = FOURCC('0', '0', 'd', 'c');
+  chunk.size = hdr_len + data_len;
+  uint32_t chunk_len = sizeof(chunk) + chunk.size + (chunk.size & 1);
+
+  if (!avi_state.valid) {
+    return false;
+  }
+
+  if (!avi_state.finalized &&
+      (avi_state.movi_size + chunk_len > AVI_MAX_MOVI_SIZE ||
+       avi_state.width != width || avi_state.height != height)) {
+    avi_finalize();
+  }
+
+  if (avi_state.finalized) {
+    if (!avi_create(width, height)) {
+      return false;
+    }
+  }
+
+  // Grow the file in large steps, the frame is then written into already
+  // allocated clusters. If this fails the frame is appended as usual.
+  uint32_t frame_end = AVI_MOVI_OFFSET + avi_state.movi_size + chunk_len;
+  if (cfg.getPrealloc() && frame_end > avi_state.alloc_size) {
+    uint32_t alloc_size = (frame_end + AVI_PREALLOC_STEP - 1) /
+                          AVI_PREALLOC_STEP * AVI_PREALLOC_STEP;
+    if (storage_set_file_size(avi_path, alloc_size)) {
+      avi_state.alloc_size = alloc_size;
+    }
+  }
+
+  FILE *file = fopen(avi_path, "r+");
+  if (file == NULL) {
+    Serial.printf("Could not open AVI file: %s\n", avi_path);
+    return false;
+  }
+
+  bool success = false;
+  if (fseek(file, AVI_MOVI_OFFSET + avi_state.movi_size, SEEK_SET) != 0 ||
+      fwrite(&chunk, sizeof(chunk), 1, file) != 1 ||
+      (hdr_len != 0 && fwrite(hdr, hdr_len, 1, file) != 1) ||
+      fwrite(data, data_len, 1, file) != 1 ||
+      ((chunk.size & 1) && fputc(0, file) == EOF)) {
+    Serial.println("Error while writing frame to AVI file");
+    goto done;
+  }
+
+  avi_state.frames++;
+  avi_state.movi_size += chunk_len;
+  if (chunk.size > avi_state.max_frame_size) {
+    avi_state.max_frame_size = chunk.size;
+  }
+
+  // Update header to include new frame
+  AviHeader avi_hdr;
+  avi_fill_header(&avi_hdr, false);
+  if (fseek(file, 0, SEEK_SET) != 0 ||
+      fwrite(&avi_hdr, sizeof(avi_hdr), 1, file) != 1) {
+    Serial.println("Error while updating AVI header");
+    goto done;
+  }
+
+  success = true;
+
+done:
+  fclose(file);
+
+  return success;
+}
+
+bool avi_finalize()
+{
+  if (!avi_state.valid || avi_state.finalized) {
+    return true;
+  }
+
+  // Even if writing the index fails, start a new file for the next frame
+  avi_state.finalized = true;
+  avi_state.file_idx++;
+
+  FILE *file = fopen(avi_path, "r+");
+  if (file == NULL) {
+    Serial.printf("Could not open AVI file: %s\n", avi_path);
+    return false;
+  }
+
+  Serial.printf("Finalizing AVI file: %s... ", avi_path);
+
+  // Collect the whole index in PSRAM, so the movi list is read in a single
+  // forward pass. Every seek between the movi list and the index at the end of
+  // the file follows the FAT cluster chain from the start of the file, which
+  // takes long on a large file. Without PSRAM fall back to small batches.
+  size_t entry_max = avi_state.frames;
+  AviIndexEntry *entries = (AviIndexEntry *) heap_caps_malloc(
+      entry_max * sizeof(AviIndexEntry), MALLOC_CAP_SPIRAM);
+  if (entries == NULL) {
+    entry_max = AVI_IDX_BATCH;
+    entries = (AviIndexEntry *) malloc(entry_max * sizeof(AviIndexEntry));
+  }
+  if (entries == NULL) {
+    Serial.println("Failed\nOut of memory");
+    fclose(file);
+    return false;
+  }
+
+  bool success = false;
+  size_t entry_cnt = 0;
+  uint32_t chunk_pos = AVI_MOVI_OFFSET + sizeof(((AviHeader *) 0)->movi);
+  uint32_t movi_end = AVI_MOVI_OFFSET + avi_state.movi_size;
+  uint32_t idx_pos = movi_end + sizeof(AviChunkHeader);
+
+  AviChunkHeader idx_hdr;
+  idx_hdr.id = FOURCC('i', 'd', 'x', '1');
+  idx_hdr.size = avi_state.frames * sizeof(AviIndexEntry);
+
+  // Walk the movi list and write the index when the buffer is full
+  while (chunk_pos < movi_end) {
+    AviChunkHeader chunk;
+    if (fseek(file, chunk_pos, SEEK_SET) != 0 ||
+        fread(&chunk, sizeof(chunk), 1, file) != 1) {
+      Serial.println("Failed\nError while reading AVI chunk header");
+      goto done;
+    }
+
+    entries[entry_cnt].id = chunk.id;
+    entries[entry_cnt].flags = AVIIF_KEYFRAME;
+    entries[entry_cnt].offset = chunk_pos - AVI_MOVI_OFFSET;
+    entries[entry_cnt].size = chunk.size;
+    entry_cnt++;
+
+    chunk_pos += sizeof(chunk) + chunk.size + (chunk.size & 1);
+
+    if (entry_cnt == entry_max || chunk_pos >= movi_end) {
+      if (fseek(file, idx_pos, SEEK_SET) != 0 ||
+          fwrite(entries, sizeof(entries[0]), entry_cnt, file) != entry_cnt) {
+        Serial.println("Failed\nError while writing AVI index");
+        goto done;
+      }
+      idx_pos += entry_cnt * sizeof(entries[0]);
+      entry_cnt = 0;
+    }
+  }
+
+  // Write idx1 chunk header and final AVI header
+  AviHeader avi_hdr;
+  avi_fill_header(&avi_hdr, true);
+  avi_hdr.riff_size += sizeof(idx_hdr) + idx_hdr.size;
+  if (fseek(file, movi_end, SEEK_SET) != 0 ||
+      fwrite(&idx_hdr, sizeof(idx_hdr), 1, file) != 1 ||
+      fseek(file, 0, SEEK_SET) != 0 ||
+      fwrite(&avi_hdr, sizeof(avi_hdr), 1, file) != 1) {
+    Serial.println("Failed\nError while writing AVI header");
+    goto done;
+  }
+
+  Serial.println("Done");
+  success = true;
+
+done:
+  free(entries);
+  fclose(file);
+
+  // Drop pre-allocated space beyond the index
+  uint32_t file_size = idx_pos;
+  if (success && avi_state.alloc_size > file_size &&
+      !storage_set_file_size(avi_path, file_size)) {
+    success = false;
+  }
+
+  return success;
+}
+
+const char *avi_get_path()
+{
+  return avi_path;
+}
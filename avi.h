@@ -0,0 +1,87 @@
+/**
+ * avi.h - Append images to a MJPEG AVI file
+ *
+ * Copyright (c) 2019, David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __AVI_H__
+#define __AVI_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Playback frame rate stored in AVI header
+#define AVI_FRAME_RATE 10
+
+/**
+ * Open AVI file for appending frames
+ *
+ * If the previous AVI file, as stored in RTC memory, is in the same directory
+ * it is continued. Else a new file is created when the first frame is added.
+ *
+ * @param dir	Directory to store the AVI file(s) in
+ *
+ * @returns	True on success, else false
+ */
+bool avi_open(const char *dir);
+
+/**
+ * Append JPEG frame to AVI file
+ *
+ * The frame is stored as the concatenation of hdr and data. The file headers
+ * are updated after every frame, so the file is always playable. However the
+ * idx1 index is only written when the file is finalized.
+ *
+ * If the file would grow beyond AVI_MAX_MOVI_SIZE it is finalized, and a new
+ * file is started.
+ *
+ * @param hdr		JPEG/Exif header, or NULL
+ * @param hdr_len	Length of hdr
+ * @param data		JPEG data following the header
+ * @param data_len	Length of data
+ * @param width		Frame width
+ * @param height	Frame height
+ *
+ * @returns	True on success, else false
+ */
+bool avi_add_frame(const uint8_t *hdr, size_t hdr_len,
+                   const uint8_t *data, size_t data_len,
+                   uint16_t width, uint16_t height);
+
+/**
+ * Finalize AVI file
+ *
+ * Rebuilds the idx1 index from the chunks in the movi list and appends it to
+ * the file. The next frame will start a new file.
+ *
+ * @returns	True on success, else false
+ */
+bool avi_finalize();
+
+/**
+ * Get path of current AVI file
+ */
+const char *avi_get_path();
+
+#endif // __AVI_H__
@@ -27,169 +27,185 @@
  */
 #include "config.h"
 
+#include <math.h>
+
 #include "Arduino.h"
 #include "esp_camera.h"
+#include "esp_jpg_decode.h"
+#include "esp_system.h" // esp_reset_reason()
 #include "driver/rtc_io.h" // rtc_gpio_hold_en()
+#include "freertos/FreeRTOS.h" // portENTER_CRITICAL()
 
 #include "camera.h"
+#include "jpeg.h"
 #include "io_defs.h"
 #include "configuration.h"
 
+// OV2640 sensor bank registers holding the state of the AEC/AGC/AWB loops.
+// Bit 8 selects the sensor register bank.
+#define OV2640_REG_GAIN 0x100
+#define OV2640_REG_BLUE 0x101
+#define OV2640_REG_RED 0x102
+#define OV2640_REG_REG04 0x104 // AEC[1:0]
+#define OV2640_REG_AEC 0x110 // AEC[9:2]
+#define OV2640_REG_REG45 0x145 // AEC[15:10]
+#define OV2640_REG_CLKRC 0x111 // Clock doubler and divider
+#define OV2640_REG_COM7 0x112 // Resolution mode
+#define OV2640_REG_REG2A 0x12A // Dummy pixels[11:8]
+#define OV2640_REG_FRARL 0x12B // Dummy pixels[7:0]
+
+// Camera input clock frequency, in Hz
+#define CAMERA_XCLK_FREQ 20000000
+
+// F-number of the standard ESP32-CAM lens
+#define CAMERA_F_NUMBER 2.0f
+
 /**
- * Configure the camera based on current system configuration
+ * Sensor registers stored in the frame info
+ *
+ * The first EXPOSURE_REG_CNT registers hold the exposure state. The order
+ * must match the REG_IDX_* values.
  */
-bool camera_reconfigure()
-{
-  int res;
-  sensor_t *s = esp_camera_sensor_get();
-
-  res = s->set_framesize(s, cfg.getFrameSize());
-  if (res != 0) {
-    Serial.printf("Unable to set 'frame size': return code %d\n", res);
-    return false;
-  }
-
-  res = s->set_quality(s, cfg.getQuality());
-  if (res != 0) {
-    Serial.printf("Unable to set 'quality': return code %d\n", res);
-    return false;
-  }
-
-  res = s->set_contrast(s, cfg.getContrast());
-  if (res != 0) {
-    Serial.printf("Unable to set 'contrast': return code %d\n", res);
-    return false;
-  }
-
-  res = s->set_brightness(s, cfg.getBrightness());
-  if (res != 0) {
-    Serial.printf("Unable to set 'brightness': return code %d\n", res);
-    return false;
-  }
-
-  res = s->set_saturation(s, cfg.getSaturation());
-  if (res != 0) {
-    Serial.printf("Unable to set 'saturation': return code %d\n", res);
-    return false;
-  }
+static const uint16_t frame_info_regs[CAMERA_REG_DUMP_CNT] = {
+  OV2640_REG_REG04,
+  OV2640_REG_AEC,
+  OV2640_REG_REG45,
+  OV2640_REG_GAIN,
+  OV2640_REG_BLUE,
+  OV2640_REG_RED,
+  OV2640_REG_CLKRC,
+  OV2640_REG_COM7,
+  OV2640_REG_REG2A,
+  OV2640_REG_FRARL,
+};
+enum {
+  REG_IDX_REG04,
+  REG_IDX_AEC,
+  REG_IDX_REG45,
+  REG_IDX_GAIN,
+  REG_IDX_BLUE,
+  REG_IDX_RED,
+  REG_IDX_CLKRC,
+  REG_IDX_COM7,
+  REG_IDX_REG2A,
+  REG_IDX_FRARL,
+};
+#define EXPOSURE_REG_CNT (REG_IDX_RED + 1)
 
-  res = s->set_colorbar(s, cfg.getColorBar());
-  if (res != 0) {
-    Serial.printf("Unable to set 'colorbar': return code %d\n", res);
-    return false;
-  }
-
-  res = s->set_hmirror(s, cfg.getHMirror());
-  if (res != 0) {
-    Serial.printf("Unable to set 'hmirror': return code %d\n", res);
-    return false;
-  }
-
-  res = s->set_vflip(s, cfg.getVFlip());
-  if (res != 0) {
-    Serial.printf("Unable to set 'vflip': return code %d\n", res);
-    return false;
-  }
-
-  res = s->set_whitebal(s, cfg.getAwb());
-  if (res != 0) {
-    Serial.printf("Unable to set 'whitebal': return code %d\n", res);
-    return false;
-  }
-
-  res = s->set_awb_gain(s, cfg.getAwbGain());
-  if (res != 0) {
-    Serial.printf("Unable to set 'awb_gain': return code %d\n", res);
-    return false;
-  }
-
-  res = s->set_wb_mode(s, cfg.getWhiteBalanceMode());
-  if (res != 0) {
-    Serial.printf("Unable to set 'wb_mode': return code %d\n", res);
-    return false;
-  }
-
-  res = s->set_gain_ctrl(s, cfg.getAgc());
-  if (res != 0) {
-    Serial.printf("Unable to set 'gain_ctrl': return code %d\n", res);
-    return false;
-  }
-
-  res = s->set_agc_gain(s, cfg.getAgcGain());
-  if (res != 0) {
-    Serial.printf("Unable to set 'agc_gain': return code %d\n", res);
-    return false;
-  }
-
-  res = s->set_gainceiling(s, cfg.getGainCeiling());
-  if (res != 0) {
-    Serial.printf("Unable to set 'gainceiling': return code %d\n", res);
-    return false;
-  }
-
-  res = s->set_exposure_ctrl(s, cfg.getAec());
-  if (res != 0) {
-    Serial.printf("Unable to set 'exposure_ctrl': return code %d\n", res);
-    return false;
-  }
-
-  res = s->set_aec_value(s, cfg.getExposureValue());
-  if (res != 0) {
-    Serial.printf("Unable to set 'aec_value': return code %d\n", res);
-    return false;
-  }
-
-  res = s->set_aec2(s, cfg.getAec2());
-  if (res != 0) {
-    Serial.printf("Unable to set 'aec2': return code %d\n", res);
-    return false;
-  }
+/**
+ * Exposure state of camera sensor
+ */
+typedef struct {
+  uint16_t aec; /**< Exposure time, in line periods */
+  uint8_t gain; /**< AGC gain */
+  uint8_t blue; /**< AWB blue channel gain */
+  uint8_t red; /**< AWB red channel gain */
+} camera_exposure_t;
 
-  res = s->set_ae_level(s, cfg.getAeLevel());
-  if (res != 0) {
-    Serial.printf("Unable to set 'ae_level': return code %d\n", res);
-    return false;
-  }
+// Amount of times to retry capturing if the frame is invalid
+#define CAMERA_CAPTURE_RETRIES 2
 
-  res = s->set_dcw(s, cfg.getDcw());
-  if (res != 0) {
-    Serial.printf("Unable to set 'dcw': return code %d\n", res);
-    return false;
-  }
+// Amount of frame buffers allocated by the camera driver
+static size_t camera_fb_count = 1;
 
-  res = s->set_bpc(s, cfg.getBlackPixelCancellation());
-  if (res != 0) {
-    Serial.printf("Unable to set 'bpc': return code %d\n", res);
-    return false;
-  }
+// Amount of frame slots, one for every frame buffer that can be held
+#define CAMERA_FRAME_SLOTS 2
 
-  res = s->set_wpc(s, cfg.getWhitePixelCancellation());
-  if (res != 0) {
-    Serial.printf("Unable to set 'wpc': return code %d\n", res);
-    return false;
-  }
+/**
+ * Information of captured frames that are not yet returned to the driver
+ */
+static struct {
+  const camera_fb_t *fb; /**< Frame the slot belongs to, NULL if unused */
+  bool has_info; /**< info is valid */
+  camera_frame_info_t info;
+  uint8_t *thumb_buf; /**< CAMERA_THUMBNAIL_MAX bytes, allocated on first use */
+  size_t thumb_len; /**< Length of thumbnail, 0 if none */
+} frames[CAMERA_FRAME_SLOTS];
+
+// Protects the fb, has_info, info and thumb_len fields of frames[]. With the
+// capture pipeline, slots are claimed by the capturing task and released by
+// the writer task.
+static portMUX_TYPE frames_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Magic value to detect valid exposure state in RTC memory
+#define EXPOSURE_STATE_MAGIC 0x45585030
 
-  res = s->set_raw_gma(s, cfg.getRawGamma());
-  if (res != 0) {
-    Serial.printf("Unable to set 'raw_gma': return code %d\n", res);
-    return false;
-  }
+/**
+ * Exposure state of last capture in RTC memory
+ *
+ * Restored after initializing the camera when waking from deep sleep, so the
+ * AEC/AGC/AWB loops start from the previous state instead of the defaults.
+ */
+RTC_DATA_ATTR static struct {
+  uint32_t magic;
+  framesize_t frame_size; /**< Frame size the exposure was determined for */
+  camera_exposure_t exp;
+} exposure_state;
 
-  res = s->set_lenc(s, cfg.getLensCorrection());
-  if (res != 0) {
-    Serial.printf("Unable to set 'lenc': return code %d\n", res);
-    return false;
-  }
+static void restore_exposure();
 
-  res = s->set_special_effect(s, cfg.getSpecialEffect());
-  if (res != 0) {
-    Serial.printf("Unable to set 'special_effect': return code %d\n", res);
-    return false;
-  }
+/**
+ * Apply camera setting if it differs from the driver's state
+ *
+ * The driver keeps a copy of the current sensor settings in s->status, which
+ * is read back from the sensor during esp_camera_init() and updated by every
+ * setter. Settings that already have the wanted value are skipped, unless
+ * force is set.
+ */
+#define APPLY_SETTING(field, setter, value, name) \
+  do { \
+    if (force || s->status.field != (value)) { \
+      res = s->setter(s, (value)); \
+      if (res != 0) { \
+        Serial.printf("Unable to set '" name "': return code %d\n", res); \
+        return false; \
+      } \
+      applied++; \
+    } \
+    total++; \
+  } while (0)
+
+bool camera_reconfigure(bool force)
+{
+  int res;
+  unsigned int applied = 0;
+  unsigned int total = 0;
+  sensor_t *s = esp_camera_sensor_get();
+  unsigned long start = micros();
+
+  APPLY_SETTING(framesize, set_framesize, cfg.getFrameSize(), "frame size");
+  APPLY_SETTING(quality, set_quality, cfg.getQuality(), "quality");
+  APPLY_SETTING(contrast, set_contrast, cfg.getContrast(), "contrast");
+  APPLY_SETTING(brightness, set_brightness, cfg.getBrightness(), "brightness");
+  APPLY_SETTING(saturation, set_saturation, cfg.getSaturation(), "saturation");
+  APPLY_SETTING(colorbar, set_colorbar, cfg.getColorBar(), "colorbar");
+  APPLY_SETTING(hmirror, set_hmirror, cfg.getHMirror(), "hmirror");
+  APPLY_SETTING(vflip, set_vflip, cfg.getVFlip(), "vflip");
+  APPLY_SETTING(awb, set_whitebal, cfg.getAwb(), "whitebal");
+  APPLY_SETTING(awb_gain, set_awb_gain, cfg.getAwbGain(), "awb_gain");
+  APPLY_SETTING(wb_mode, set_wb_mode, cfg.getWhiteBalanceMode(), "wb_mode");
+  APPLY_SETTING(agc, set_gain_ctrl, cfg.getAgc(), "gain_ctrl");
+  APPLY_SETTING(agc_gain, set_agc_gain, cfg.getAgcGain(), "agc_gain");
+  APPLY_SETTING(gainceiling, set_gainceiling, cfg.getGainCeiling(), "gainceiling");
+  APPLY_SETTING(aec, set_exposure_ctrl, cfg.getAec(), "exposure_ctrl");
+  APPLY_SETTING(aec_value, set_aec_value, cfg.getExposureValue(), "aec_value");
+  APPLY_SETTING(aec2, set_aec2, cfg.getAec2(), "aec2");
+  APPLY_SETTING(ae_level, set_ae_level, cfg.getAeLevel(), "ae_level");
+  APPLY_SETTING(dcw, set_dcw, cfg.getDcw(), "dcw");
+  APPLY_SETTING(bpc, set_bpc, cfg.getBlackPixelCancellation(), "bpc");
+  APPLY_SETTING(wpc, set_wpc, cfg.getWhitePixelCancellation(), "wpc");
+  APPLY_SETTING(raw_gma, set_raw_gma, cfg.getRawGamma(), "raw_gma");
+  APPLY_SETTING(lenc, set_lenc, cfg.getLensCorrection(), "lenc");
+  APPLY_SETTING(special_effect, set_special_effect, cfg.getSpecialEffect(), "special_effect");
+
+  Serial.printf("Camera reconfigured in %lu us, %u/%u settings changed\n",
+                micros() - start, applied, total);
 
   return true;
 }
 
+#undef APPLY_SETTING
+
 bool camera_init()
 {
   esp_err_t err = ESP_FAIL;
@@ -227,7 +243,7 @@ bool camera_init()
   config.pin_sscb_scl = SIOC_GPIO_NUM;
   config.pin_pwdn = PWDN_GPIO_NUM;
   config.pin_reset = RESET_GPIO_NUM;
-  config.xclk_freq_hz = 20000000;
+  config.xclk_freq_hz = CAMERA_XCLK_FREQ;
   config.pixel_format = PIXFORMAT_JPEG;
   //init with high specs to pre-allocate larger buffers
   if (psramFound()) {
@@ -247,8 +263,19 @@ bool camera_init()
     Serial.printf("Camera init failed with error 0x%x", err);
     return false;
   }
+  camera_fb_count = config.fb_count;
+
+  // esp_camera_init() resets the sensor and fills its status with the
+  // defaults it wrote. Write all settings after a cold boot, in case the
+  // status doesn't match the registers. After deep sleep only the settings
+  // that differ from the defaults need to be written.
+  if (!camera_reconfigure(esp_reset_reason() != ESP_RST_DEEPSLEEP)) {
+    return false;
+  }
+
+  restore_exposure();
 
-  return camera_reconfigure();
+  return true;
 }
 
 void camera_deinit()
@@ -263,7 +290,610 @@ void camera_deinit()
 #endif // WITH_CAM_PWR_SHUTDOWN
 }
 
-camera_fb_t *camera_capture()
+void camera_standby(bool enable)
+{
+#if PWDN_GPIO_NUM >= 0
+  digitalWrite(PWDN_GPIO_NUM, enable ? HIGH : LOW);
+#endif // PWDN_GPIO_NUM >= 0
+}
+
+/**
+ * Read sensor registers
+ *
+ * @param regs	Used to return the values of the first cnt registers of
+ *		frame_info_regs[]
+ *
+ * @returns	True on success, false if the registers couldn't be read
+ */
+static bool read_regs(sensor_t *s, uint8_t *regs, unsigned int cnt)
+{
+  for (unsigned int i = 0; i < cnt; i++) {
+    int val = s->get_reg(s, frame_info_regs[i], 0xff);
+    if (val < 0) {
+      return false;
+    }
+    regs[i] = val;
+  }
+
+  return true;
+}
+
+/**
+ * Decode exposure state from raw sensor registers
+ */
+static void exposure_from_regs(const uint8_t *regs, camera_exposure_t *exp)
+{
+  exp->aec = (regs[REG_IDX_REG45] & 0x3f) << 10 |
+             regs[REG_IDX_AEC] << 2 |
+             (regs[REG_IDX_REG04] & 0x03);
+  exp->gain = regs[REG_IDX_GAIN];
+  exp->blue = regs[REG_IDX_BLUE];
+  exp->red = regs[REG_IDX_RED];
+}
+
+/**
+ * Read current exposure state from sensor
+ *
+ * @returns	True on success, false if the registers couldn't be read
+ */
+static bool read_exposure(sensor_t *s, camera_exposure_t *exp)
+{
+  uint8_t regs[EXPOSURE_REG_CNT];
+
+  if (!read_regs(s, regs, EXPOSURE_REG_CNT)) {
+    return false;
+  }
+
+  exposure_from_regs(regs, exp);
+
+  return true;
+}
+
+/**
+ * Read exposure state and frame info from sensor
+ *
+ * The exposure time is derived from the AEC value and the line period. The
+ * line period follows from the sensor clock and the line length of the
+ * resolution mode, as documented in the OV2640 datasheet. The ISO speed
+ * assumes ISO 100 at unity gain.
+ *
+ * @returns	True on success, false if the registers couldn't be read
+ */
+static bool read_frame_info(sensor_t *s, camera_frame_info_t *info,
+                            camera_exposure_t *exp)
+{
+  uint8_t regs[CAMERA_REG_DUMP_CNT];
+
+  if (!read_regs(s, regs, CAMERA_REG_DUMP_CNT)) {
+    return false;
+  }
+
+  exposure_from_regs(regs, exp);
+
+  for (unsigned int i = 0; i < CAMERA_REG_DUMP_CNT; i++) {
+    info->regs[i][0] = frame_info_regs[i] & 0xff;
+    info->regs[i][1] = regs[i];
+  }
+
+  // Exposure time
+  uint32_t sysclk = CAMERA_XCLK_FREQ / ((regs[REG_IDX_CLKRC] & 0x3f) + 1);
+  if (regs[REG_IDX_CLKRC] & 0x80) {
+    sysclk *= 2;
+  }
+
+  uint32_t line_len;
+  switch (regs[REG_IDX_COM7] & 0x70) {
+  case 0x40: // SVGA
+    line_len = 1190;
+    break;
+  case 0x20: // CIF
+    line_len = 595;
+    break;
+  default: // UXGA
+    line_len = 1922;
+    break;
+  }
+  line_len += ((regs[REG_IDX_REG2A] & 0xf0) << 4) | regs[REG_IDX_FRARL];
+
+  info->exposure_us = (uint64_t) exp->aec * line_len * 1000000 / sysclk;
+
+  // Gain = (bit7 + 1) * (bit6 + 1) * (bit5 + 1) * (bit4 + 1) * (1 + bit[3:0] / 16)
+  uint32_t iso = 100 * (16 + (exp->gain & 0x0f)) / 16;
+  for (uint8_t bits = exp->gain >> 4; bits != 0; bits >>= 1) {
+    if (bits & 1) {
+      iso *= 2;
+    }
+  }
+  info->iso = iso;
+
+  // APEX brightness: Bv = Av + Tv - Sv
+  float exposure = (info->exposure_us > 0 ? info->exposure_us : 1) / 1e6f;
+  float bv = 2 * log2f(CAMERA_F_NUMBER) - log2f(exposure) -
+             log2f(info->iso / 3.125f);
+  info->brightness = lroundf(bv * 100);
+
+  return true;
+}
+
+/**
+ * Write exposure state to sensor
+ *
+ * Only the values of the loops that are enabled are written, manually
+ * configured values are left alone.
+ */
+static bool write_exposure(sensor_t *s, const camera_exposure_t *exp)
+{
+  int res = 0;
+
+  if (cfg.getAec()) {
+    res |= s->set_reg(s, OV2640_REG_REG04, 0x03, exp->aec & 0x03);
+    res |= s->set_reg(s, OV2640_REG_AEC, 0xff, (exp->aec >> 2) & 0xff);
+    res |= s->set_reg(s, OV2640_REG_REG45, 0x3f, (exp->aec >> 10) & 0x3f);
+  }
+  if (cfg.getAgc()) {
+    res |= s->set_reg(s, OV2640_REG_GAIN, 0xff, exp->gain);
+  }
+  if (cfg.getAwb()) {
+    res |= s->set_reg(s, OV2640_REG_BLUE, 0xff, exp->blue);
+    res |= s->set_reg(s, OV2640_REG_RED, 0xff, exp->red);
+  }
+
+  return res == 0;
+}
+
+/**
+ * Restore exposure state of last capture from RTC memory
+ */
+static void restore_exposure()
+{
+  if (exposure_state.magic != EXPOSURE_STATE_MAGIC ||
+      exposure_state.frame_size != cfg.getFrameSize()) {
+    return;
+  }
+
+  sensor_t *s = esp_camera_sensor_get();
+  if (write_exposure(s, &exposure_state.exp)) {
+    Serial.printf("Restored exposure: aec=%u, gain=%u, blue=%u, red=%u\n",
+                  exposure_state.exp.aec, exposure_state.exp.gain,
+                  exposure_state.exp.blue, exposure_state.exp.red);
+  } else {
+    Serial.println("Failed to restore exposure");
+  }
+}
+
+/**
+ * Save exposure state to RTC memory
+ *
+ * @param exp	Exposure state of sensor, or NULL to invalidate the saved state
+ */
+static void save_exposure(const camera_exposure_t *exp)
+{
+  exposure_state.magic = 0;
+  if (exp != NULL) {
+    exposure_state.exp = *exp;
+    exposure_state.frame_size = cfg.getFrameSize();
+    exposure_state.magic = EXPOSURE_STATE_MAGIC;
+  }
+}
+
+/**
+ * Check if two values differ less than tolerance percent
+ */
+static bool within_tolerance(uint32_t a, uint32_t b, unsigned int tolerance)
+{
+  uint32_t diff = (a > b) ? a - b : b - a;
+  uint32_t max = (a > b) ? a : b;
+
+  // Always allow for rounding of small values
+  return diff <= 1 || diff * 100 <= max * tolerance;
+}
+
+static bool exposure_converged(const camera_exposure_t *a,
+                               const camera_exposure_t *b,
+                               unsigned int tolerance)
+{
+  return within_tolerance(a->aec, b->aec, tolerance) &&
+         within_tolerance(a->gain, b->gain, tolerance) &&
+         within_tolerance(a->blue, b->blue, tolerance) &&
+         within_tolerance(a->red, b->red, tolerance);
+}
+
+/**
+ * Take shots to train the AGC/AEC/AWB
+ *
+ * Takes up to training_shots images. If training_tolerance is set, stops as
+ * soon as the exposure state of the sensor is stable between two images. If
+ * the sensor registers can't be read, the JPEG size is compared instead.
+ */
+static void train()
+{
+  sensor_t *s = esp_camera_sensor_get();
+  unsigned int max_shots = cfg.getTrainingShots();
+  unsigned int tolerance = cfg.getTrainingTolerance();
+  camera_exposure_t prev_exp = {}, exp;
+  size_t prev_len = 0;
+  unsigned int shots;
+
+  Serial.print("Training... ");
+  for (shots = 0; shots < max_shots; shots++) {
+    camera_fb_t *fb = esp_camera_fb_get();
+    if (fb == NULL) {
+      break;
+    }
+    size_t len = fb->len;
+    esp_camera_fb_return(fb);
+
+    if (tolerance == 0) {
+      continue;
+    }
+
+    bool converged;
+    if (read_exposure(s, &exp)) {
+      converged = (shots > 0 &&
+                   exposure_converged(&prev_exp, &exp, tolerance));
+      prev_exp = exp;
+    } else {
+      converged = (shots > 0 && within_tolerance(prev_len, len, tolerance));
+    }
+    prev_len = len;
+
+    if (converged) {
+      shots++;
+      break;
+    }
+  }
+  Serial.printf("Done, %u/%u shots\n", shots, max_shots);
+}
+
+/**
+ * Capture a valid JPEG frame
+ *
+ * Frames that are not a complete JPEG stream, i.e. because they were
+ * truncated, are dropped and captured again, at most CAMERA_CAPTURE_RETRIES
+ * times. So are frames that don't have the current frame size, which were
+ * queued before switch_frame_size(). Data after the JPEG EOI marker is
+ * trimmed from the frame.
+ *
+ * @returns	Frame buffer, or NULL on failure
+ */
+static camera_fb_t *capture_frame()
+{
+  framesize_t frame_size = esp_camera_sensor_get()->status.framesize;
+
+  for (int attempt = 0; attempt <= CAMERA_CAPTURE_RETRIES; attempt++) {
+    camera_fb_t *fb = esp_camera_fb_get();
+    if (fb == NULL) {
+      return NULL;
+    }
+
+    if (fb->width != resolution[frame_size].width ||
+        fb->height != resolution[frame_size].height) {
+      Serial.printf("Stale %ux%u frame, ", (unsigned int) fb->width,
+                    (unsigned int) fb->height);
+      esp_camera_fb_return(fb);
+      continue;
+    }
+
+    jpeg_info_t info;
+    if (jpeg_parse(fb->buf, fb->len, &info) == JPEG_OK) {
+      fb->len = info.len;
+      return fb;
+    }
+
+    Serial.printf("Invalid frame (%s), ", jpeg_strerror(info.status));
+    esp_camera_fb_return(fb);
+  }
+
+  return NULL;
+}
+
+/**
+ * Take burst of images and select the one with the largest JPEG size
+ *
+ * At most two frame buffers are held at any time: the best frame so far, and
+ * the frame being compared against it.
+ */
+static camera_fb_t *capture_best(unsigned int count)
+{
+  camera_fb_t *best = capture_frame();
+  unsigned int best_idx = 0;
+
+  if (camera_fb_count < 2) {
+    // Holding on to a frame would block the driver, just keep the last one
+    for (unsigned int i = 1; i < count && best != NULL; i++) {
+      esp_camera_fb_return(best);
+      best = capture_frame();
+    }
+    return best;
+  }
+
+  for (unsigned int i = 1; i < count && best != NULL; i++) {
+    camera_fb_t *fb = capture_frame();
+    if (fb == NULL) {
+      break;
+    }
+
+    if (fb->len > best->len) {
+      esp_camera_fb_return(best);
+      best = fb;
+      best_idx = i;
+    } else {
+      esp_camera_fb_return(fb);
+    }
+  }
+
+  if (best != NULL) {
+    Serial.printf("selected %u/%u (%u bytes)... ", best_idx + 1, count,
+                  best->len);
+  }
+
+  return best;
+}
+
+/**
+ * Change frame size of sensor
+ *
+ * The driver keeps capturing into free frame buffers, so the frame that was
+ * in flight while changing the frame size is dropped. Frames that were
+ * already queued with the previous size are dropped by capture_frame().
+ */
+static bool switch_frame_size(sensor_t *s, framesize_t frame_size)
+{
+  if (s->set_framesize(s, frame_size) != 0) {
+    return false;
+  }
+
+  camera_fb_t *fb = esp_camera_fb_get();
+  if (fb != NULL) {
+    esp_camera_fb_return(fb);
+  }
+
+  return true;
+}
+
+/**
+ * Claim frame slot for captured frame
+ *
+ * @returns	Slot index, or -1 if no slot is free
+ */
+static int claim_frame_slot(const camera_fb_t *fb)
+{
+  int slot = -1;
+
+  portENTER_CRITICAL(&frames_mux);
+  for (unsigned int i = 0; i < CAMERA_FRAME_SLOTS; i++) {
+    if (frames[i].fb == NULL) {
+      frames[i].has_info = false;
+      frames[i].thumb_len = 0;
+      frames[i].fb = fb;
+      slot = i;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&frames_mux);
+
+  return slot;
+}
+
+/**
+ * Capture thumbnail for frame
+ *
+ * Temporarily switches the sensor to the thumbnail frame size and stores the
+ * captured JPEG in the frame slot. The main frame is held meanwhile, so this
+ * requires at least two frame buffers.
+ */
+static void capture_thumbnail(unsigned int slot)
+{
+  sensor_t *s = esp_camera_sensor_get();
+  framesize_t main_size = s->status.framesize;
+  framesize_t thumb_size = FRAMESIZE_QQVGA;
+  camera_fb_t *fb;
+
+  if (camera_fb_count < 2) {
+    return;
+  }
+
+  if (cfg.getThumbnail() == Configuration::ThumbnailQvga) {
+    thumb_size = FRAMESIZE_QVGA;
+  }
+
+  if (frames[slot].thumb_buf == NULL) {
+    frames[slot].thumb_buf = (uint8_t *) heap_caps_malloc(
+        CAMERA_THUMBNAIL_MAX, MALLOC_CAP_SPIRAM);
+    if (frames[slot].thumb_buf == NULL) {
+      Serial.print("no memory for thumbnail... ");
+      return;
+    }
+  }
+
+  if (!switch_frame_size(s, thumb_size)) {
+    Serial.print("unable to set thumbnail frame size... ");
+    return;
+  }
+
+  fb = capture_frame();
+  if (fb != NULL && fb->len <= CAMERA_THUMBNAIL_MAX) {
+    memcpy(frames[slot].thumb_buf, fb->buf, fb->len);
+    portENTER_CRITICAL(&frames_mux);
+    frames[slot].thumb_len = fb->len;
+    portEXIT_CRITICAL(&frames_mux);
+    Serial.printf("thumbnail %u bytes... ", fb->len);
+  } else {
+    Serial.print("thumbnail failed... ");
+  }
+  if (fb != NULL) {
+    esp_camera_fb_return(fb);
+  }
+
+  if (!switch_frame_size(s, main_size)) {
+    Serial.println("Unable to restore frame size");
+  }
+}
+
+/**
+ * State of decoding a probe frame into a luminance grid
+ */
+typedef struct {
+  const camera_fb_t *fb;
+  uint16_t width; /**< Width of decoded image */
+  uint16_t height; /**< Height of decoded image */
+  uint32_t sum[CAMERA_GRID_H * CAMERA_GRID_W];
+  uint16_t cnt[CAMERA_GRID_H * CAMERA_GRID_W];
+} probe_t;
+
+/**
+ * esp_jpg_decode() reader callback, reads from probe frame buffer
+ */
+static size_t probe_read(void *arg, size_t index, uint8_t *buf, size_t len)
+{
+  const camera_fb_t *fb = ((probe_t *) arg)->fb;
+
+  if (index >= fb->len) {
+    return 0;
+  }
+  if (len > fb->len - index) {
+    len = fb->len - index;
+  }
+  if (buf != NULL) {
+    memcpy(buf, &fb->buf[index], len);
+  }
+
+  return len;
+}
+
+/**
+ * esp_jpg_decode() writer callback, accumulates RGB888 blocks into grid
+ */
+static bool probe_write(void *arg, uint16_t x, uint16_t y,
+                        uint16_t w, uint16_t h, uint8_t *data)
+{
+  probe_t *p = (probe_t *) arg;
+
+  if (data == NULL) {
+    // Start or end of image
+    if (x == 0 && y == 0) {
+      p->width = w;
+      p->height = h;
+    }
+    return p->width != 0 && p->height != 0;
+  }
+
+  for (uint16_t row = 0; row < h; row++) {
+    unsigned int cell_y = (y + row) * CAMERA_GRID_H / p->height;
+    for (uint16_t col = 0; col < w; col++) {
+      unsigned int cell_x = (x + col) * CAMERA_GRID_W / p->width;
+      unsigned int cell = cell_y * CAMERA_GRID_W + cell_x;
+      const uint8_t *px = &data[(row * w + col) * 3];
+
+      if (cell >= CAMERA_GRID_H * CAMERA_GRID_W) {
+        continue;
+      }
+      p->sum[cell] += (px[0] + 2 * px[1] + px[2]) / 4;
+      p->cnt[cell]++;
+    }
+  }
+
+  return true;
+}
+
+bool camera_probe(uint8_t *grid)
+{
+  sensor_t *s = esp_camera_sensor_get();
+  framesize_t main_size = s->status.framesize;
+  static probe_t probe;
+  camera_fb_t *fb;
+  bool retval = false;
+
+  if (!switch_frame_size(s, FRAMESIZE_QQVGA)) {
+    Serial.println("Unable to set probe frame size");
+    return false;
+  }
+
+  fb = capture_frame();
+  if (fb != NULL) {
+    // Only the DC coefficients are decoded when scaling down 8 times
+    memset(&probe, 0, sizeof(probe));
+    probe.fb = fb;
+    if (esp_jpg_decode(fb->len, JPG_SCALE_8X,
+                       probe_read, probe_write, &probe) == ESP_OK) {
+      for (unsigned int i = 0; i < CAMERA_GRID_H * CAMERA_GRID_W; i++) {
+        grid[i] = (probe.cnt[i] != 0) ? probe.sum[i] / probe.cnt[i] : 0;
+      }
+      retval = true;
+    } else {
+      Serial.println("Unable to decode probe frame");
+    }
+    esp_camera_fb_return(fb);
+  } else {
+    Serial.println("Probe capture failed");
+  }
+
+  if (!switch_frame_size(s, main_size)) {
+    Serial.println("Unable to restore frame size");
+  }
+
+  return retval;
+}
+
+bool camera_get_frame_info(const camera_fb_t *fb, camera_frame_info_t *info)
+{
+  if (fb == NULL) {
+    return false;
+  }
+
+  bool found = false;
+
+  portENTER_CRITICAL(&frames_mux);
+  for (unsigned int i = 0; i < CAMERA_FRAME_SLOTS; i++) {
+    if (frames[i].fb == fb && frames[i].has_info) {
+      *info = frames[i].info;
+      found = true;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&frames_mux);
+
+  return found;
+}
+
+bool camera_get_thumbnail(const camera_fb_t *fb,
+                          const uint8_t **buf, size_t *len)
+{
+  if (fb == NULL) {
+    return false;
+  }
+
+  bool found = false;
+
+  // The thumbnail buffer stays valid while the caller holds the frame
+  portENTER_CRITICAL(&frames_mux);
+  for (unsigned int i = 0; i < CAMERA_FRAME_SLOTS; i++) {
+    if (frames[i].fb == fb && frames[i].thumb_len != 0) {
+      *buf = frames[i].thumb_buf;
+      *len = frames[i].thumb_len;
+      found = true;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&frames_mux);
+
+  return found;
+}
+
+void camera_fb_return(camera_fb_t *fb)
+{
+  portENTER_CRITICAL(&frames_mux);
+  for (unsigned int i = 0; i < CAMERA_FRAME_SLOTS; i++) {
+    if (frames[i].fb == fb) {
+      frames[i].fb = NULL;
+    }
+  }
+  portEXIT_CRITICAL(&frames_mux);
+
+  esp_camera_fb_return(fb);
+}
+
+camera_fb_t *camera_capture(bool do_train)
 {
   camera_fb_t *fb;
 
@@ -275,17 +905,41 @@ camera_fb_t *camera_capture()
 #endif // WITH_FLASH
 
   // Take some shots to train the AGC/AWB
-  Serial.print("Training:");
-  for (int i=cfg.getTrainingShots(); i != 0; i--) {
-    Serial.printf(" %d", i);
-    fb = esp_camera_fb_get();
-    esp_camera_fb_return(fb);
+  if (do_train) {
+    train();
   }
-  Serial.println(" Done");
 
   // Take picture
   Serial.print("Taking picture... ");
-  fb = esp_camera_fb_get();
+  if (cfg.getBurstSelect() == Configuration::BurstSelectBest &&
+      cfg.getBurstCount() > 1) {
+    fb = capture_best(cfg.getBurstCount());
+  } else {
+    fb = capture_frame();
+  }
+
+  if (fb != NULL) {
+    sensor_t *s = esp_camera_sensor_get();
+    int slot = claim_frame_slot(fb);
+    camera_frame_info_t info;
+    camera_exposure_t exp;
+
+    if (read_frame_info(s, &info, &exp)) {
+      save_exposure(&exp);
+      if (slot >= 0) {
+        portENTER_CRITICAL(&frames_mux);
+        frames[slot].info = info;
+        frames[slot].has_info = true;
+        portEXIT_CRITICAL(&frames_mux);
+      }
+    } else {
+      save_exposure(NULL);
+    }
+
+    if (slot >= 0 && cfg.getThumbnail() != Configuration::ThumbnailNone) {
+      capture_thumbnail(slot);
+    }
+  }
 
   // Disable Flash
 #ifdef WITH_FLASH
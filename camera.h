@@ -28,6 +28,27 @@
 #ifndef __CAMERA_H__
 #define __CAMERA_H__
 
+// Maximum size of a thumbnail JPEG
+#define CAMERA_THUMBNAIL_MAX (32 * 1024)
+
+// Size of the luminance grid returned by camera_probe()
+#define CAMERA_GRID_W 16
+#define CAMERA_GRID_H 12
+
+// Amount of raw sensor registers in camera_frame_info_t
+#define CAMERA_REG_DUMP_CNT 10
+
+/**
+ * Exposure information of a captured frame
+ */
+typedef struct {
+  uint32_t exposure_us; /**< Exposure time, in microseconds */
+  uint16_t iso; /**< ISO speed */
+  int16_t brightness; /**< APEX brightness value, in 1/100 EV */
+  uint8_t regs[CAMERA_REG_DUMP_CNT][2]; /**< Sensor bank register address and
+                                          value pairs */
+} camera_frame_info_t;
+
 /**
  * Initialize camera
  */
@@ -38,21 +59,77 @@ bool camera_init();
  */
 void camera_deinit();
 
+/**
+ * Put camera in, or take it out of, standby
+ *
+ * Uses the camera power down pin, if available. The camera stays initialized
+ * and keeps its configuration.
+ */
+void camera_standby(bool enable);
+
 /**
  * Configure the camera based on current system configuration
+ *
+ * Only settings that differ from the current sensor state are written.
+ *
+ * @param force	Write all settings
  */
-bool camera_reconfigure();
+bool camera_reconfigure(bool force=false);
 
 /**
  * Capture image
+ *
+ * If burst_select is best, takes burst_count images and returns the one with
+ * the largest JPEG size.
+ *
+ * @param do_train	Take training shots first
+ */
+camera_fb_t *camera_capture(bool do_train);
+
+/**
+ * Capture coarse luminance grid of the scene
+ *
+ * Captures a QQVGA frame and decodes only the DC coefficients of the JPEG
+ * data, which is much cheaper than capturing and storing a full frame.
+ *
+ * @param grid	Used to return CAMERA_GRID_H rows of CAMERA_GRID_W luminance
+ *		values
+ *
+ * @returns	True on success, else false
+ */
+bool camera_probe(uint8_t *grid);
+
+/**
+ * Get exposure information of captured image
+ *
+ * The sensor registers are read right after capturing the image.
+ *
+ * @param fb	Frame buffer returned by camera_capture()
+ * @param info	Used to return the frame information
+ *
+ * @returns	True if the information is available, else false
+ */
+bool camera_get_frame_info(const camera_fb_t *fb, camera_frame_info_t *info);
+
+/**
+ * Get thumbnail of captured image
+ *
+ * A thumbnail is captured together with the image if the thumbnail option is
+ * enabled. The buffer stays valid until the image is returned with
+ * camera_fb_return().
+ *
+ * @param fb	Frame buffer returned by camera_capture()
+ * @param buf	Used to return pointer to the thumbnail JPEG
+ * @param len	Used to return the length of the thumbnail JPEG
+ *
+ * @returns	True if a thumbnail is available, else false
  */
-camera_fb_t *camera_capture();
+bool camera_get_thumbnail(const camera_fb_t *fb,
+                          const uint8_t **buf, size_t *len);
 
 /**
  * Return image buffer to driver
  */
-static inline void camera_fb_return(camera_fb_t *buf) {
-  esp_camera_fb_return(buf);
-}
+void camera_fb_return(camera_fb_t *buf);
 
 #endif // __CAMERA_H__
@@ -0,0 +1,107 @@
+/**
+ * change.cpp - Scene change detection
+ *
+ * Copyright (c) 2019, David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+
+#include "Arduino.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_camera.h"
+
+#include "camera.h"
+#include "change.h"
+#include "configuration.h"
+
+// Minimal luminance difference for a grid cell to count as changed
+#define CHANGE_CELL_DELTA 12
+
+// Magic value to detect valid change detection state in RTC memory
+#define CHANGE_STATE_MAGIC 0x43484730
+
+/**
+ * Change detection state in RTC memory
+ */
+RTC_DATA_ATTR static struct {
+  uint32_t magic;
+  uint32_t skipped; /**< Intervals skipped since last stored image */
+  uint8_t grid[CAMERA_GRID_H * CAMERA_GRID_W]; /**< Grid of last stored image */
+} change_state;
+
+bool change_detect()
+{
+  unsigned int threshold = cfg.getChangeThreshold();
+  unsigned int keyframe = cfg.getChangeKeyframe();
+  uint8_t grid[CAMERA_GRID_H * CAMERA_GRID_W];
+  unsigned int changed = 0;
+
+  if (threshold == 0) {
+    return true;
+  }
+
+  Serial.print("Probing scene... ");
+  if (!camera_probe(grid)) {
+    // Rather store too much than miss something
+    change_state.magic = 0;
+    return true;
+  }
+
+  if (change_state.magic != CHANGE_STATE_MAGIC) {
+    Serial.println("no reference");
+    goto store;
+  }
+
+  for (unsigned int i = 0; i < CAMERA_GRID_H * CAMERA_GRID_W; i++) {
+    if (abs(grid[i] - change_state.grid[i]) > CHANGE_CELL_DELTA) {
+      changed++;
+    }
+  }
+  changed = changed * 100 / (CAMERA_GRID_H * CAMERA_GRID_W);
+
+  if (changed >= threshold) {
+    Serial.printf("%u%% changed\n", changed);
+    goto store;
+  }
+
+  if (keyframe != 0 && change_state.skipped + 1 >= keyframe) {
+    Serial.printf("%u%% changed, keyframe\n", changed);
+    goto store;
+  }
+
+  change_state.skipped++;
+  Serial.printf("%u%% changed, skipping\n", changed);
+
+  return false;
+
+store:
+  memcpy(change_state.grid, grid, sizeof(change_state.grid));
+  change_state.skipped = 0;
+  change_state.magic = CHANGE_STATE_MAGIC;
+
+  return true;
+}
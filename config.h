@@ -11,4 +11,10 @@
 // Minimal unix time for clock to be considered valid.
 #define NOT_BEFORE_TIME 1568184212
 
+// Mount point of the SD card in the VFS. The host test build maps it to a
+// temporary directory.
+#ifndef SDCARD_MOUNT_POINT
+#define SDCARD_MOUNT_POINT "/sdcard"
+#endif
+
 #endif // __CONFIG_H__
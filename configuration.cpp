@@ -29,17 +29,60 @@
 
 #include <Arduino.h>
 
+#include <ctype.h>
+#include <math.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "rom/crc.h"
 
 #include "configuration.h"
 #include "parse_kv_file.h"
 
+#define ARRAY_SIZE(a) (sizeof(a)/sizeof((a)[0]))
+
+// Size of buffer used to generate the configuration file
+#define CONFIG_FILE_MAX 2048
+
+// Magic value to detect a valid configuration cache. Includes the object size
+// so a cache created by a different firmware layout is never used.
+#define CONFIG_CACHE_MAGIC (0x43464700 ^ sizeof(Configuration))
+
 static bool parse_int(const char *in, int *out);
+static bool parse_degrees(const char *in, int *out);
+static bool parse_schedule(const char *in, schedule_t *schedule);
+static int format_schedule(const schedule_t *schedule, char *buf, size_t size);
 static bool parse_bool(const char *in, bool *out);
 
 Configuration cfg;
 
+/**
+ * Parsed configuration cached in RTC memory
+ *
+ * Used to skip parsing the configuration file after waking up from deep
+ * sleep. Only valid if the configuration file's modification time and size
+ * still match.
+ */
+RTC_DATA_ATTR static struct {
+  uint32_t magic;
+  uint32_t crc; /**< CRC32 over all fields below */
+  time_t mtime; /**< Modification time of parsed configuration file */
+  off_t size; /**< Size of parsed configuration file */
+  uint32_t parse_usec; /**< Time it took to parse the configuration file */
+  uint8_t image[sizeof(Configuration)] __attribute__((aligned(4)));
+} cfg_cache;
+
+static uint32_t cfg_cache_crc()
+{
+  const uint8_t *start = (const uint8_t *) &cfg_cache.mtime;
+  const uint8_t *end = (const uint8_t *) &cfg_cache + sizeof(cfg_cache);
+  return crc32_le(0, start, end - start);
+}
+
 static const PROGMEM char * frame_size_strings[] = {
 "96x96",
 "160x120",
@@ -71,6 +114,41 @@ static const PROGMEM char * wb_mode_strings[] = {
 "office",
 "home"
 };
+static const PROGMEM char * output_format_strings[] = {
+"jpeg",
+"avi"
+};
+static const PROGMEM char * burst_select_strings[] = {
+"all",
+"best"
+};
+static const PROGMEM char * shard_mode_strings[] = {
+"none",
+"day",
+"hour",
+"count"
+};
+static const PROGMEM char * thumbnail_strings[] = {
+"none",
+"qqvga",
+"qvga"
+};
+static const PROGMEM char * night_mode_strings[] = {
+"off",
+"skip",
+"interval"
+};
+static const PROGMEM char * missed_capture_strings[] = {
+"catchup",
+"skip",
+"coalesce"
+};
+static const PROGMEM char * sleep_mode_strings[] = {
+"auto",
+"deep",
+"light",
+"none"
+};
 static const PROGMEM char * special_effect_strings[] = {
 "none",
 "negative",
@@ -117,6 +195,22 @@ static bool parse_int(const char *in, int *out)
     return true;
 }
 
+/**
+ * Parse decimal degrees string into millionths of a degree
+ *
+ * @returns true on success, false on error
+ */
+static bool parse_degrees(const char *in, int *out)
+{
+    char *endp;
+    double tmp = strtod(in, &endp);
+    if (endp == in || *endp != '\0' || tmp < -360 || tmp > 360) {
+      return false;
+    }
+    *out = lround(tmp * 1000000);
+    return true;
+}
+
 /**
  * Parse boolean string
  *
@@ -139,424 +233,688 @@ static bool parse_bool(const char *in, bool *out)
     return true;
 }
 
-int Configuration::config_set(const char *key, const char *value)
+/**
+ * Parse semicolon separated list of schedule rules
+ *
+ * The rules are appended to schedule. An empty string removes all rules.
+ *
+ * @returns true on success, false on error. schedule is unchanged on error.
+ */
+static bool parse_schedule(const char *in, schedule_t *schedule)
 {
-  char *endp = NULL;
-
-  Serial.printf(" - '%s' => '%s'", key, value);
-  Serial.println();
+    schedule_t tmp = *schedule;
 
-  if (strcasecmp(key, "interval") == 0) {
-    m_capture_interval = strtoul(value, &endp, 10);
-    if (endp == NULL) {
-      Serial.println("Value for 'interval' is not a valid integer number");
-      return -2;
+    if (*in == '\0') {
+      memset(schedule, 0, sizeof(*schedule));
+      return true;
     }
-    if (m_capture_interval < 1000) {
-      // Date/Time filename format doesn't support intervals < 1 Second.
-      Serial.println("Capture interval to small, changing to 1 Sec.");
-      m_capture_interval = 1000;
-    }
-  } else if (strcasecmp(key, "ssid") == 0 ||
-             strcasecmp(key, "password") == 0 ||
-             strcasecmp(key, "ntp_server") == 0) {
-    Serial.printf("WARNING: ignoring deprecated option '%s'\n", key);
-  } else if (strcasecmp(key, "timezone") == 0) {
-    if (strlen(value) > sizeof(m_tzinfo) - 1) {
-      Serial.printf("Value of 'tzinfo' too long (>= %d byte)\n",
-                        sizeof(m_tzinfo));
-      return -2;
+
+    while (*in != '\0') {
+      char rule[64];
+      size_t len = strcspn(in, ";");
+
+      // Strip spaces from the front and back of the rule
+      while (len > 0 && isspace((unsigned char) *in)) {
+        in++;
+        len--;
+      }
+      while (len > 0 && isspace((unsigned char) in[len - 1])) {
+        len--;
+      }
+
+      if (len >= sizeof(rule) || tmp.count >= SCHEDULE_RULES_MAX) {
+        return false;
+      }
+      memcpy(rule, in, len);
+      rule[len] = '\0';
+      if (!schedule_parse_rule(rule, &tmp.rules[tmp.count])) {
+        return false;
+      }
+      tmp.count++;
+
+      in += len;
+      in += strspn(in, " \t");
+      if (*in == ';') {
+        in++;
+      }
     }
-    strcpy(m_tzinfo, value);
-  } else if (strcasecmp(key, "rotation") == 0) {
-    int int_value;
-    if (parse_int(value, &int_value) != true) {
-      Serial.printf("Value of '%s' is not a valid integer\n", key);
-      return -2;
+
+    *schedule = tmp;
+    return true;
+}
+
+/**
+ * Format schedule rules as semicolon separated list
+ *
+ * @returns	Length of the formatted list, as snprintf()
+ */
+static int format_schedule(const schedule_t *schedule, char *buf, size_t size)
+{
+    size_t len = 0;
+
+    if (size > 0) {
+      buf[0] = '\0';
+    }
+    for (unsigned int i = 0; i < schedule->count; i++) {
+      if (i > 0) {
+        len += snprintf(&buf[len < size ? len : size],
+                        len < size ? size - len : 0, "; ");
+      }
+      len += schedule_format_rule(&schedule->rules[i],
+                                  &buf[len < size ? len : size],
+                                  len < size ? size - len : 0);
     }
-    if (int_value == 0) { // 0 deg. rotation
-      m_orientation = 1;
-    } else if (int_value == 90 || int_value == -270) { // 90° CW / 270° CCW
-      m_orientation = 6;
-    } else if (int_value == 180 || int_value == -180) { // 180° CW/CCW
-      m_orientation = 3;
-    } else if (int_value == 270 || int_value == -90) { // 270° CW / 90° CCW
-      m_orientation = 8;
+
+    return len;
+}
+
+/**
+ * Frame size names accepted in addition to the resolution strings
+ */
+static const struct {
+  const char *name;
+  framesize_t frame_size;
+} frame_size_names[] = {
+  { "QQVGA", FRAMESIZE_QQVGA },
+  { "QCIF", FRAMESIZE_QCIF },
+  { "HQVGA", FRAMESIZE_HQVGA },
+  { "QVGA", FRAMESIZE_QVGA },
+  { "CIF", FRAMESIZE_CIF },
+  { "VGA", FRAMESIZE_VGA },
+  { "SVGA", FRAMESIZE_SVGA },
+  { "XGA", FRAMESIZE_XGA },
+  { "SXGA", FRAMESIZE_SXGA },
+  { "UXGA", FRAMESIZE_UXGA },
+  { "QXGA", FRAMESIZE_QXGA }, // OV3660 only
+};
+
+#define OPT_FIELD(member) \
+  offsetof(Configuration, member), sizeof(((Configuration *) 0)->member)
+#define OPT_BOOL(key, member, def) \
+  { key, OptionTypeBool, OPT_FIELD(member), 0, 1, def, NULL, NULL }
+#define OPT_INT(key, member, min, max, def) \
+  { key, OptionTypeInt, OPT_FIELD(member), min, max, def, NULL, NULL }
+#define OPT_ENUM(key, member, strings, def) \
+  { key, OptionTypeEnum, OPT_FIELD(member), 0, ARRAY_SIZE(strings) - 1, def, \
+    strings, NULL }
+#define OPT_STRING(key, member, def) \
+  { key, OptionTypeString, OPT_FIELD(member), 0, 0, 0, NULL, def }
+#define OPT_SPECIAL(key, type, member, min, max, def) \
+  { key, type, OPT_FIELD(member), min, max, def, NULL, NULL }
+#define OPT_DEPRECATED(key) \
+  { key, OptionTypeDeprecated, 0, 0, 0, 0, 0, NULL, NULL }
+
+/**
+ * Configuration schema
+ *
+ * Used for parsing, defaults, JSON export and saving. Options are exported and
+ * saved in this order.
+ */
+const Configuration::Option Configuration::options[] = {
+  OPT_SPECIAL("interval", OptionTypeInterval, m_capture_interval,
+              1000, INT32_MAX, 5000),
+  OPT_BOOL("enable_busy_led", m_enable_busy_led, true),
+  OPT_BOOL("enable_flash", m_enable_flash, false),
+  OPT_INT("training_shots", m_training_shots, 0, INT32_MAX, 0),
+  OPT_INT("training_tolerance", m_training_tolerance, 0, 100, 0),
+  OPT_INT("burst_count", m_burst_count, 1, 16, 1),
+  OPT_ENUM("burst_select", m_burst_select, burst_select_strings,
+           BurstSelectAll),
+  OPT_BOOL("pipeline", m_pipeline, false),
+  OPT_ENUM("sleep_mode", m_sleep_mode, sleep_mode_strings, SleepModeAuto),
+  OPT_ENUM("output_format", m_output_format, output_format_strings,
+           OutputFormatJpeg),
+  OPT_ENUM("shard_mode", m_shard_mode, shard_mode_strings, ShardModeNone),
+  OPT_INT("shard_size", m_shard_size, 1, INT32_MAX, 1000),
+  OPT_BOOL("prealloc", m_prealloc, false),
+  OPT_INT("write_buffer_size", m_write_buffer_size, 0, 65536, 0),
+  OPT_INT("min_free_space", m_min_free_space, 0, INT32_MAX, 0),
+  OPT_ENUM("thumbnail", m_thumbnail, thumbnail_strings, ThumbnailNone),
+  OPT_INT("change_threshold", m_change_threshold, 0, 100, 0),
+  OPT_INT("change_keyframe", m_change_keyframe, 0, INT32_MAX, 0),
+  OPT_ENUM("night_mode", m_night_mode, night_mode_strings, NightModeOff),
+  OPT_SPECIAL("night_interval", OptionTypeInterval, m_night_interval,
+              1000, INT32_MAX, 600000),
+  OPT_INT("night_elevation", m_night_elevation, -18, 10, -6),
+  OPT_SPECIAL("latitude", OptionTypeDegrees, m_latitude,
+              -90000000, 90000000, 0),
+  OPT_SPECIAL("longitude", OptionTypeDegrees, m_longitude,
+              -180000000, 180000000, 0),
+  OPT_SPECIAL("schedule", OptionTypeSchedule, m_schedule, 0, 0, 0),
+  OPT_ENUM("missed_capture", m_missed_capture, missed_capture_strings,
+           MissedCaptureCatchUp),
+  OPT_STRING("timezone", m_tzinfo, "GMT0"),
+  OPT_SPECIAL("rotation", OptionTypeRotation, m_orientation, 0, 0, 1),
+  OPT_SPECIAL("framesize", OptionTypeFrameSize, m_frame_size,
+              0, ARRAY_SIZE(frame_size_strings) - 1, FRAMESIZE_UXGA),
+  OPT_INT("quality", m_quality, 10, 63, 10),
+  OPT_INT("contrast", m_contrast, -2, 2, 0),
+  OPT_INT("brightness", m_brightness, -2, 2, 0),
+  OPT_INT("saturation", m_saturation, -2, 2, 0),
+  OPT_BOOL("colorbar", m_colorbar, false),
+  OPT_BOOL("hmirror", m_hmirror, false),
+  OPT_BOOL("vflip", m_vflip, false),
+  OPT_BOOL("awb", m_awb, true),
+  OPT_BOOL("awb_gain", m_awb_gain, true),
+  OPT_ENUM("wb_mode", m_wb_mode, wb_mode_strings, WbModeAuto),
+  OPT_BOOL("agc", m_agc, true),
+  OPT_SPECIAL("agc_gain", OptionTypeAgcGain, m_agc_gain, 1, 32, 1),
+  OPT_INT("gainceiling", m_gainceiling, 0, 6, GAINCEILING_8X),
+  OPT_BOOL("aec", m_aec, true),
+  OPT_INT("aec_value", m_aec_value, 0, 1200, 51),
+  OPT_BOOL("aec2", m_aec2, true),
+  OPT_INT("ae_level", m_ae_level, -2, 2, 0),
+  OPT_BOOL("dcw", m_dcw, true),
+  OPT_BOOL("bpc", m_bpc, false),
+  OPT_BOOL("wpc", m_wpc, true),
+  OPT_BOOL("raw_gma", m_raw_gma, true),
+  OPT_BOOL("lenc", m_lenc, true),
+  OPT_ENUM("special_effect", m_special_effect, special_effect_strings,
+           SpecialEffectNone),
+  OPT_DEPRECATED("ssid"),
+  OPT_DEPRECATED("password"),
+  OPT_DEPRECATED("ntp_server"),
+};
+
+#define OPTION_COUNT ARRAY_SIZE(Configuration::options)
+
+/**
+ * Read integer member of given size
+ */
+static int get_int(const uint8_t *field, size_t size, bool is_signed)
+{
+  switch (size) {
+  case 1:
+    return is_signed ? *(const int8_t *) field : *(const uint8_t *) field;
+  case 2:
+    return is_signed ? *(const int16_t *) field : *(const uint16_t *) field;
+  default:
+    return *(const int32_t *) field;
+  }
+}
+
+/**
+ * Write integer member of given size
+ */
+static void set_int(uint8_t *field, size_t size, int value)
+{
+  switch (size) {
+  case 1:
+    *(uint8_t *) field = value;
+    break;
+  case 2:
+    *(uint16_t *) field = value;
+    break;
+  default:
+    *(int32_t *) field = value;
+    break;
+  }
+}
+
+/**
+ * Find option in schema
+ *
+ * Uses a binary search over an index of the options sorted by key. The index
+ * is built on first use.
+ *
+ * @returns	Schema entry, or NULL if the key is unknown
+ */
+const Configuration::Option *Configuration::findOption(const char *key)
+{
+  static uint8_t sorted[OPTION_COUNT];
+  static bool sorted_valid = false;
+
+  if (!sorted_valid) {
+    // Insertion sort
+    for (size_t i = 0; i < OPTION_COUNT; i++) {
+      size_t j = i;
+      while (j > 0 &&
+             strcasecmp(options[sorted[j - 1]].key, options[i].key) > 0) {
+        sorted[j] = sorted[j - 1];
+        j--;
+      }
+      sorted[j] = i;
+    }
+    sorted_valid = true;
+  }
+
+  size_t low = 0;
+  size_t high = OPTION_COUNT;
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    const Option *opt = &options[sorted[mid]];
+    int cmp = strcasecmp(key, opt->key);
+    if (cmp == 0) {
+      return opt;
+    } else if (cmp < 0) {
+      high = mid;
     } else {
-      Serial.printf("Value of '%s' is out of range\n", key);
-      return -2;
+      low = mid + 1;
     }
-  } else if (strcasecmp(key, "enable_busy_led") == 0) {
-    if (parse_bool(value, &(m_enable_busy_led)) != true) {
-      Serial.printf("Value of '%s' is not a valid boolean\n", key);
-      return -2;
+  }
+
+  return NULL;
+}
+
+void Configuration::setDefaults()
+{
+  for (size_t i = 0; i < OPTION_COUNT; i++) {
+    const Option *opt = &options[i];
+    uint8_t *field = (uint8_t *) this + opt->offset;
+
+    switch (opt->type) {
+    case OptionTypeBool:
+      *(bool *) field = opt->def;
+      break;
+    case OptionTypeString:
+      strncpy((char *) field, opt->def_str, opt->size - 1);
+      field[opt->size - 1] = '\0';
+      break;
+    case OptionTypeSchedule:
+      memset(field, 0, opt->size);
+      break;
+    case OptionTypeDeprecated:
+      break;
+    default:
+      set_int(field, opt->size, opt->def);
+      break;
     }
-  } else if (strcasecmp(key, "enable_flash") == 0) {
-    if (parse_bool(value, &(m_enable_flash)) != true) {
+  }
+}
+
+int Configuration::config_set(const char *key, const char *value)
+{
+  Serial.printf(" - '%s' => '%s'", key, value);
+  Serial.println();
+
+  const Option *opt = findOption(key);
+  if (opt == NULL) {
+    Serial.printf("Unknown key '%s', ignoring\n", key);
+    return 0;
+  }
+
+  uint8_t *field = (uint8_t *) this + opt->offset;
+  int int_value;
+
+  switch (opt->type) {
+  case OptionTypeBool:
+    if (parse_bool(value, (bool *) field) != true) {
       Serial.printf("Value of '%s' is not a valid boolean\n", key);
       return -2;
     }
-  } else if (strcasecmp(key, "training_shots") == 0) {
-    int int_value;
+    break;
+
+  case OptionTypeInt:
+  case OptionTypeInterval:
+  case OptionTypeAgcGain:
     if (parse_int(value, &int_value) != true) {
       Serial.printf("Value of '%s' is not a valid integer\n", key);
       return -2;
     }
-    if (int_value < 0) {
-      Serial.printf("Value of '%s' is out of range\n", key);
-      return -2;
-    }
-    m_training_shots = int_value;
-  } else if(!strcasecmp(key, "framesize")) {
-    if (strcasecmp(value, "QQVGA") == 0 ||
-        strcasecmp(value, "160x120") == 0) {
-      m_frame_size = FRAMESIZE_QQVGA;
-    } else if (strcasecmp(value, "QCIF") == 0 ||
-        strcasecmp(value, "176x144") == 0) {
-      m_frame_size = FRAMESIZE_QCIF;
-    } else if (strcasecmp(value, "HQVGA") == 0 ||
-        strcasecmp(value, "240x176") == 0) {
-      m_frame_size = FRAMESIZE_HQVGA;
-    } else if (strcasecmp(value, "QVGA") == 0 ||
-        strcasecmp(value, "320x240") == 0) {
-      m_frame_size = FRAMESIZE_QVGA;
-    } else if (strcasecmp(value, "CIF") == 0 ||
-        strcasecmp(value, "400x296") == 0) {
-      m_frame_size = FRAMESIZE_CIF;
-    } else if (strcasecmp(value, "VGA") == 0 ||
-        strcasecmp(value, "640x480") == 0) {
-      m_frame_size = FRAMESIZE_VGA;
-    } else if (strcasecmp(value, "SVGA") == 0 ||
-        strcasecmp(value, "800x600") == 0) {
-      m_frame_size = FRAMESIZE_SVGA;
-    } else if (strcasecmp(value, "XGA") == 0 ||
-        strcasecmp(value, "1024x768") == 0) {
-      m_frame_size = FRAMESIZE_XGA;
-    } else if (strcasecmp(value, "SXGA") == 0 ||
-        strcasecmp(value, "1280x1024") == 0) {
-      m_frame_size = FRAMESIZE_SXGA;
-    } else if (strcasecmp(value, "UXGA") == 0 ||
-        strcasecmp(value, "1600x1200") == 0) {
-      m_frame_size = FRAMESIZE_UXGA;
-    } else if (strcasecmp(value, "QXGA") == 0 ||
-        strcasecmp(value, "2048x1536") == 0) {
-      m_frame_size = FRAMESIZE_QXGA; // OV3660 only
-    } else {
-      Serial.printf("Invalid value for '%s'\n", key);
-      return -2;
-    }
-  } else if(!strcasecmp(key, "quality")) {
-    int int_value;
-    if (parse_int(value, &int_value) != true) {
-      Serial.printf("Value of '%s' is not a valid integer\n", key);
-      return -2;
+    if (opt->type == OptionTypeInterval && int_value < opt->min) {
+      // Date/Time filename format doesn't support intervals < 1 Second.
+      Serial.printf("Value of '%s' too small, changing to %d ms\n",
+                    opt->key, (int) opt->min);
+      int_value = opt->min;
     }
-    if (int_value < 10 || int_value > 63) {
+    if (int_value < opt->min || int_value > opt->max) {
       Serial.printf("Value of '%s' is out of range\n", key);
       return -2;
     }
+    if (opt->type == OptionTypeAgcGain) {
+      int_value -= 1;
+    }
+    set_int(field, opt->size, int_value);
+    break;
 
-    m_quality = int_value;
-  } else if(!strcasecmp(key, "contrast")) {
-    int int_value;
-    if (parse_int(value, &int_value) != true) {
-      Serial.printf("Value of '%s' is not a valid integer\n", key);
-      return -2;
+  case OptionTypeEnum:
+    for (int_value = opt->min; int_value <= opt->max; int_value++) {
+      if (strcasecmp(value, opt->strings[int_value]) == 0) {
+        break;
+      }
     }
-    if (int_value < -2 || int_value > 2) {
-      Serial.printf("Value of '%s' is out of range\n", key);
+    if (int_value > opt->max) {
+      Serial.printf("Invalid value for '%s'\n", key);
       return -2;
     }
+    set_int(field, opt->size, int_value);
+    break;
 
-    m_contrast = int_value;
-  } else if(!strcasecmp(key, "brightness")) {
-    int int_value;
-    if (parse_int(value, &int_value) != true) {
-      Serial.printf("Value of '%s' is not a valid integer\n", key);
-      return -2;
-    }
-    if (int_value < -2 || int_value > 2) {
-      Serial.printf("Value of '%s' is out of range\n", key);
+  case OptionTypeString:
+    if (strlen(value) > opt->size - 1U) {
+      Serial.printf("Value of '%s' too long (>= %d byte)\n", key, opt->size);
       return -2;
     }
+    strcpy((char *) field, value);
+    break;
 
-    m_brightness = int_value;
-  } else if(!strcasecmp(key, "saturation")) {
-    int int_value;
+  case OptionTypeRotation:
     if (parse_int(value, &int_value) != true) {
       Serial.printf("Value of '%s' is not a valid integer\n", key);
       return -2;
     }
-    if (int_value < -2 || int_value > 2) {
-      Serial.printf("Value of '%s' is out of range\n", key);
-      return -2;
-    }
-    m_saturation = int_value;
-  } else if(!strcasecmp(key, "colorbar")) {
-    if (parse_bool(value, &m_colorbar) != true) {
-      Serial.printf("Value of '%s' is not a valid boolean\n", key);
-      return -2;
-    }
-  } else if(!strcasecmp(key, "hmirror")) {
-    if (parse_bool(value, &m_hmirror) != true) {
-      Serial.printf("Value of '%s' is not a valid boolean\n", key);
-      return -2;
-    }
-  } else if(!strcasecmp(key, "vflip")) {
-    if (parse_bool(value, &m_vflip) != true) {
-      Serial.printf("Value of '%s' is not a valid boolean\n", key);
-      return -2;
-    }
-  } else if(!strcasecmp(key, "awb")) {
-    if (parse_bool(value, &m_awb) != true) {
-      Serial.printf("Value of '%s' is not a valid boolean\n", key);
-      return -2;
-    }
-  } else if(!strcasecmp(key, "awb_gain")) {
-    if (parse_bool(value, &m_awb_gain) != true) {
-      Serial.printf("Value of '%s' is not a valid boolean\n", key);
-      return -2;
-    }
-  } else if(!strcasecmp(key, "wb_mode")) {
-    if (strcasecmp(value, "auto") == 0) {
-      m_wb_mode = WbModeAuto;
-    } else if (strcasecmp(value, "sunny") == 0) {
-      m_wb_mode = WbModeSunny;
-    } else if (strcasecmp(value, "cloudy") == 0) {
-      m_wb_mode = WbModeCloudy;
-    } else if (strcasecmp(value, "office") == 0) {
-      m_wb_mode = WbModeOffice;
-    } else if (strcasecmp(value, "home") == 0) {
-      m_wb_mode = WbModeHome;
+    if (int_value == 0) { // 0 deg. rotation
+      *field = 1;
+    } else if (int_value == 90 || int_value == -270) { // 90° CW / 270° CCW
+      *field = 6;
+    } else if (int_value == 180 || int_value == -180) { // 180° CW/CCW
+      *field = 3;
+    } else if (int_value == 270 || int_value == -90) { // 270° CW / 90° CCW
+      *field = 8;
     } else {
-      Serial.printf("Invalid value for '%s'\n", key);
-      return -2;
-    }
-  } else if(!strcasecmp(key, "agc")) {
-    if (parse_bool(value, &m_agc) != true) {
-      Serial.printf("Value of '%s' is not a valid boolean\n", key);
-      return -2;
-    }
-  } else if(!strcasecmp(key, "agc_gain")) {
-    int int_value;
-    if (parse_int(value, &int_value) != true) {
-      Serial.printf("Value of '%s' is not a valid integer\n", key);
-      return -2;
-    }
-    if (int_value < 1 || int_value > 32) {
       Serial.printf("Value of '%s' is out of range\n", key);
       return -2;
     }
-    m_agc_gain = int_value - 1;
-  } else if(!strcasecmp(key, "gainceiling")) {
-    int int_value;
-    if (parse_int(value, &int_value) != true) {
-      Serial.printf("Value of '%s' is not a valid integer\n", key);
-      return -2;
-    }
-    if (int_value < 0 || int_value > 6) {
-      Serial.printf("Value of '%s' is out of range\n", key);
-      return -2;
-    }
-    m_gainceiling = (gainceiling_t) int_value;
-  } else if(!strcasecmp(key, "aec")) {
-    if (parse_bool(value, &m_aec) != true) {
-      Serial.printf("Value of '%s' is not a valid boolean\n", key);
-      return -2;
-    }
-  } else if(!strcasecmp(key, "aec_value")) {
-    int int_value;
-    if (parse_int(value, &int_value) != true) {
-      Serial.printf("Value of '%s' is not a valid integer\n", key);
-      return -2;
-    }
-    if (int_value < 0 || int_value > 1200) {
-      Serial.printf("Value of '%s' is out of range\n", key);
-      return -2;
+    break;
+
+  case OptionTypeFrameSize:
+    int_value = -1;
+    for (size_t i = 0; i < ARRAY_SIZE(frame_size_names); i++) {
+      framesize_t frame_size = frame_size_names[i].frame_size;
+      if (strcasecmp(value, frame_size_names[i].name) == 0 ||
+          strcasecmp(value, frame_size_strings[frame_size]) == 0) {
+        int_value = frame_size;
+        break;
+      }
     }
-    m_aec_value = int_value;
-  } else if(!strcasecmp(key, "aec2")) {
-    if (parse_bool(value, &m_aec2) != true) {
-      Serial.printf("Value of '%s' is not a valid boolean\n", key);
+    if (int_value < 0) {
+      Serial.printf("Invalid value for '%s'\n", key);
       return -2;
     }
-  } else if(!strcasecmp(key, "ae_level")) {
-    int int_value;
-    if (parse_int(value, &int_value) != true) {
-      Serial.printf("Value of '%s' is not a valid integer\n", key);
+    set_int(field, opt->size, int_value);
+    break;
+
+  case OptionTypeDegrees:
+    if (parse_degrees(value, &int_value) != true) {
+      Serial.printf("Value of '%s' is not a valid number\n", key);
       return -2;
     }
-    if (int_value < -2 || int_value > 2) {
+    if (int_value < opt->min || int_value > opt->max) {
       Serial.printf("Value of '%s' is out of range\n", key);
       return -2;
     }
-    m_ae_level = int_value;
-  } else if(!strcasecmp(key, "dcw")) {
-    if (parse_bool(value, &m_dcw) != true) {
-      Serial.printf("Value of '%s' is not a valid boolean\n", key);
-      return -2;
-    }
-  } else if(!strcasecmp(key, "bpc")) {
-    if (parse_bool(value, &m_bpc) != true) {
-      Serial.printf("Value of '%s' is not a valid boolean\n", key);
-      return -2;
-    }
-  } else if(!strcasecmp(key, "wpc")) {
-    if (parse_bool(value, &m_wpc) != true) {
-      Serial.printf("Value of '%s' is not a valid boolean\n", key);
-      return -2;
-    }
-  } else if(!strcasecmp(key, "raw_gma")) {
-    if (parse_bool(value, &m_raw_gma) != true) {
-      Serial.printf("Value of '%s' is not a valid boolean\n", key);
-      return -2;
-    }
-  } else if(!strcasecmp(key, "lenc")) {
-    if (parse_bool(value, &m_lenc) != true) {
-      Serial.printf("Value of '%s' is not a valid boolean\n", key);
-      return -2;
-    }
-  } else if(!strcasecmp(key, "special_effect")) {
-    if (strcasecmp(value, "none") == 0) {
-      m_special_effect = SpecialEffectNone;
-    } else if (strcasecmp(value, "negative") == 0) {
-      m_special_effect = SpecialEffectNegative;
-    } else if (strcasecmp(value, "grayscale") == 0) {
-      m_special_effect = SpecialEffectGrayscale;
-    } else if (strcasecmp(value, "red tint") == 0) {
-      m_special_effect = SpecialEffectRedTint;
-    } else if (strcasecmp(value, "green tint") == 0) {
-      m_special_effect = SpecialEffectGreenTint;
-    } else if (strcasecmp(value, "blue tint") == 0) {
-      m_special_effect = SpecialEffectBlueTint;
-    } else if (strcasecmp(value, "sepia") == 0) {
-      m_special_effect = SpecialEffectSepia;
-    } else {
-      Serial.println("Invalid value for 'special_effect'");
+    set_int(field, opt->size, int_value);
+    break;
+
+  case OptionTypeSchedule:
+    if (parse_schedule(value, (schedule_t *) field) != true) {
+      Serial.printf("Invalid or too many rules for '%s'\n", key);
       return -2;
     }
-  } else {
-    Serial.printf("Unknown key '%s', ignoring\n", key);
+    break;
+
+  case OptionTypeDeprecated:
+    Serial.printf("WARNING: ignoring deprecated option '%s'\n", key);
+    break;
   }
 
   return 0;
 }
 
-String Configuration::configAsJSON() const
+/**
+ * Format value of option as string
+ *
+ * @returns	Length of the formatted value, as snprintf()
+ */
+int Configuration::formatOption(const Option *opt, char *buf,
+                                size_t size) const
 {
-  String json;
-
-  json += "{";
-  json += "\"interval\": " + String(m_capture_interval);
-  json += ",\"enable_busy_led\": " + String(m_enable_busy_led);
-  json += ",\"enable_flash\": " + String(m_enable_flash);
-  json += ",\"training_shots\": " + String(m_training_shots);
-  json += ",\"timezone\": \"" + String(m_tzinfo) + '"';
-  json += ",\"rotation\": " + String(orientation_to_rotation(m_orientation));
-  json += ",\"framesize\": \"" + String(frame_size_strings[m_frame_size]) + '"';
-  json += ",\"quality\": " + String(m_quality);
-  json += ",\"contrast\": " + String(m_contrast);
-  json += ",\"brightness\": " + String(m_brightness);
-  json += ",\"saturation\": " + String(m_saturation);
-  json += ",\"colorbar\": " + String(m_colorbar);
-  json += ",\"hmirror\": " + String(m_hmirror);
-  json += ",\"vflip\": " + String(m_vflip);
-  json += ",\"awb\": " + String(m_awb);
-  json += ",\"awb_gain\": " + String(m_awb_gain);
-  json += ",\"wb_mode\": \"" + String(wb_mode_strings[m_wb_mode]) + '"';
-  json += ",\"agc\": " + String(m_agc);
-  json += ",\"agc_gain\": " + String(m_agc_gain+1);
-  json += ",\"gainceiling\": " + String(m_gainceiling);
-  json += ",\"aec\": " + String(m_aec);
-  json += ",\"aec_value\": " + String(m_aec_value);
-  json += ",\"aec2\": " + String(m_aec2);
-  json += ",\"ae_level\": " + String(m_ae_level);
-  json += ",\"dcw\": " + String(m_dcw);
-  json += ",\"bpc\": " + String(m_bpc);
-  json += ",\"wpc\": " + String(m_wpc);
-  json += ",\"raw_gma\": " + String(m_raw_gma);
-  json += ",\"lenc\": " + String(m_lenc);
-  json += ",\"special_effect\": \"" + String(special_effect_strings[m_special_effect]) + '"';
-  json += "}";
-
-  return json;
+  const uint8_t *field = (const uint8_t *) this + opt->offset;
+  int int_value;
+
+  switch (opt->type) {
+  case OptionTypeBool:
+    return snprintf(buf, size, "%d", *(const bool *) field);
+  case OptionTypeInt:
+  case OptionTypeInterval:
+    return snprintf(buf, size, "%d", get_int(field, opt->size, opt->min < 0));
+  case OptionTypeAgcGain:
+    return snprintf(buf, size, "%d", get_int(field, opt->size, false) + 1);
+  case OptionTypeEnum:
+  case OptionTypeFrameSize:
+    int_value = get_int(field, opt->size, false);
+    if (int_value < opt->min || int_value > opt->max) {
+      return snprintf(buf, size, "%s", "");
+    }
+    if (opt->type == OptionTypeFrameSize) {
+      return snprintf(buf, size, "%s", frame_size_strings[int_value]);
+    }
+    return snprintf(buf, size, "%s", opt->strings[int_value]);
+  case OptionTypeString:
+    return snprintf(buf, size, "%s", (const char *) field);
+  case OptionTypeRotation:
+    return snprintf(buf, size, "%d", orientation_to_rotation(*field));
+  case OptionTypeDegrees:
+    int_value = get_int(field, opt->size, true);
+    return snprintf(buf, size, "%s%d.%06d", (int_value < 0) ? "-" : "",
+                    abs(int_value) / 1000000, abs(int_value) % 1000000);
+  case OptionTypeSchedule:
+    return format_schedule((const schedule_t *) field, buf, size);
+  default:
+    return snprintf(buf, size, "%s", "");
+  }
+}
+
+size_t Configuration::configAsJSON(char *buf, size_t size) const
+{
+  size_t len = 0;
+
+  // Appends to buf, while counting the full length if buf is too small
+#define JSON_APPEND(...) \
+  len += snprintf(&buf[len < size ? len : size], len < size ? size - len : 0, \
+                  __VA_ARGS__)
+
+  JSON_APPEND("{");
+  for (size_t i = 0; i < OPTION_COUNT; i++) {
+    const Option *opt = &options[i];
+    if (opt->type == OptionTypeDeprecated) {
+      continue;
+    }
+
+    bool quote = (opt->type == OptionTypeEnum ||
+                  opt->type == OptionTypeString ||
+                  opt->type == OptionTypeFrameSize ||
+                  opt->type == OptionTypeSchedule);
+    JSON_APPEND("%s\"%s\": %s", (len > 1) ? "," : "", opt->key,
+                quote ? "\"" : "");
+    len += formatOption(opt, &buf[len < size ? len : size],
+                        len < size ? size - len : 0);
+    JSON_APPEND("%s", quote ? "\"" : "");
+  }
+  JSON_APPEND("}");
+
+#undef JSON_APPEND
+
+  return len;
 }
 
 static int config_set_wrapper(const char *key, const char *value) {
   return cfg.config_set(key, value);
 }
 
+/**
+ * Parse configuration file
+ *
+ * @returns	0 on success, -1 if the file doesn't exist, else the error code
+ *		returned by parse_kv_file()
+ */
+static int parse_config_file(const char *path)
+{
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    return -1;
+  }
+
+  Serial.printf("Loading config from %s...\n", path);
+
+  int err = parse_kv_file(file, &config_set_wrapper);
+
+  fclose(file);
+
+  if (err != 0) {
+    Serial.printf("Failed to parse configuration, Error %d\n", err);
+    // Distinguish from file not found
+    return (err == -1) ? -2 : err;
+  }
+
+  Serial.println("Config loaded.");
+
+  return 0;
+}
+
 bool Configuration::loadConfig()
 {
-  FILE *file = fopen(CONFIG_PATH, "r");
-  if (file != NULL)  {
-    Serial.println("Loading config... ");
+  unsigned long start = micros();
+  struct stat st;
+  bool have_stat = (stat(CONFIG_PATH, &st) == 0);
 
-    int err = parse_kv_file(file, &config_set_wrapper);
+  if (have_stat &&
+      cfg_cache.magic == CONFIG_CACHE_MAGIC &&
+      cfg_cache.mtime == st.st_mtime &&
+      cfg_cache.size == st.st_size &&
+      cfg_cache.crc == cfg_cache_crc()) {
+    memcpy(this, cfg_cache.image, sizeof(Configuration));
 
-    fclose(file);
+    unsigned long elapsed = micros() - start;
+    Serial.printf("Config loaded from cache in %lu us, saved %ld ms\n",
+                  elapsed, ((long) cfg_cache.parse_usec - (long) elapsed) / 1000);
+    return true;
+  }
 
-    if (err != 0) {
-      Serial.printf("Failed to parse configuration, Error %d\n", err);
-      return false;
-    } else {
-      Serial.println("Config loaded.");
+  int err = parse_config_file(CONFIG_PATH);
+  if (err == 0) {
+    unsigned long parse_usec = micros() - start;
+    Serial.printf("Config parsed in %lu ms\n", parse_usec / 1000);
+
+    // Cache parsed configuration for next wake-up
+    if (have_stat) {
+      cfg_cache.mtime = st.st_mtime;
+      cfg_cache.size = st.st_size;
+      cfg_cache.parse_usec = parse_usec;
+      memcpy(cfg_cache.image, this, sizeof(Configuration));
+      cfg_cache.crc = cfg_cache_crc();
+      cfg_cache.magic = CONFIG_CACHE_MAGIC;
     }
-  } else {
+
+    return true;
+  }
+
+  // Configuration missing or broken, i.e. power was lost while saving. Fall
+  // back to the backup of the previous configuration.
+  setDefaults();
+  int bak_err = parse_config_file(CONFIG_BAK_PATH);
+  if (bak_err == 0) {
+    Serial.println("Using backup configuration");
+    return true;
+  }
+  setDefaults();
+
+  if (err == -1 && bak_err == -1) {
     Serial.println("No config found, using defaults.");
+    return true;
   }
 
-  return true;
+  return false;
 }
 
-bool Configuration::saveConfig()
+bool Configuration::saveConfig(bool minimal)
 {
   // TODO: switch from bool return to exceptions?
-  // TODO: backup old config
-
-  FILE *file = fopen(CONFIG_PATH, "w");
-  if (file != NULL)  {
-    Serial.println("Saving config... ");
-
-    // TODO: Only write values that differ from default
-    fputs("# ESP32-CAM interval - Configuration file\n", file);
-    fputs("# Configuration Generated from Set-up mode\n", file);
-    fputs("interval = ", file); fputs(String(m_capture_interval).c_str(), file); fputc('\n', file);
-    fputs("enable_busy_led = ", file); fputs(String(m_enable_busy_led).c_str(), file); fputc('\n', file);
-    fputs("enable_flash = ", file); fputs(String(m_enable_flash).c_str(), file); fputc('\n', file);
-    fputs("training_shots = ", file); fputs(String(m_training_shots).c_str(), file); fputc('\n', file);
-    fputs("timezone = ", file); fputs(m_tzinfo, file); fputc('\n', file);
-    fputs("rotation = ", file); fputs(String(orientation_to_rotation(m_orientation)).c_str(), file); fputc('\n', file);
-    fputs("framesize = ", file); fputs(frame_size_strings[m_frame_size], file); fputc('\n', file);
-    fputs("quality = ", file); fputs(String(m_quality).c_str(), file); fputc('\n', file);
-    fputs("contrast = ", file); fputs(String(m_contrast).c_str(), file); fputc('\n', file);
-    fputs("brightness = ", file); fputs(String(m_brightness).c_str(), file); fputc('\n', file);
-    fputs("saturation = ", file); fputs(String(m_saturation).c_str(), file); fputc('\n', file);
-    fputs("colorbar = ", file); fputs(String(m_colorbar).c_str(), file); fputc('\n', file);
-    fputs("hmirror = ", file); fputs(String(m_hmirror).c_str(), file); fputc('\n', file);
-    fputs("vflip = ", file); fputs(String(m_vflip).c_str(), file); fputc('\n', file);
-    fputs("awb = ", file); fputs(String(m_awb).c_str(), file); fputc('\n', file);
-    fputs("awb_gain = ", file); fputs(String(m_awb_gain).c_str(), file); fputc('\n', file);
-    fputs("wb_mode = ", file); fputs(wb_mode_strings[m_wb_mode], file); fputc('\n', file);
-    fputs("agc = ", file); fputs(String(m_agc).c_str(), file); fputc('\n', file);
-    fputs("agc_gain = ", file); fputs(String(m_agc_gain+1).c_str(), file); fputc('\n', file);
-    fputs("gainceiling = ", file); fputs(String(m_gainceiling).c_str(), file); fputc('\n', file);
-    fputs("aec = ", file); fputs(String(m_aec).c_str(), file); fputc('\n', file);
-    fputs("aec_value = ", file); fputs(String(m_aec_value).c_str(), file); fputc('\n', file);
-    fputs("aec2 = ", file); fputs(String(m_aec2).c_str(), file); fputc('\n', file);
-    fputs("ae_level = ", file); fputs(String(m_ae_level).c_str(), file); fputc('\n', file);
-    fputs("dcw = ", file); fputs(String(m_dcw).c_str(), file); fputc('\n', file);
-    fputs("bpc = ", file); fputs(String(m_bpc).c_str(), file); fputc('\n', file);
-    fputs("wpc = ", file); fputs(String(m_wpc).c_str(), file); fputc('\n', file);
-    fputs("raw_gma = ", file); fputs(String(m_raw_gma).c_str(), file); fputc('\n', file);
-    fputs("lenc = ", file); fputs(String(m_lenc).c_str(), file); fputc('\n', file);
-    fputs("special_effect = ", file); fputs(special_effect_strings[m_special_effect], file); fputc('\n', file);
+  Configuration defaults;
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *file = NULL;
+  bool retval = false;
 
-    fclose(file);
-  } else {
-    Serial.println("Unable to open config file for writing");
+  cfg_cache.magic = 0;
+
+  Serial.println("Saving config... ");
+
+  // Generate whole file in memory, so it can be written in one go
+  buf = (char *) malloc(CONFIG_FILE_MAX);
+  if (buf == NULL) {
+    Serial.println("Out of memory");
     return false;
   }
 
-  return true;
+  len = snprintf(buf, CONFIG_FILE_MAX,
+                 "# ESP32-CAM interval - Configuration file\n"
+                 "# Configuration Generated from Set-up mode\n");
+  for (size_t i = 0; i < OPTION_COUNT && len < CONFIG_FILE_MAX; i++) {
+    const Option *opt = &options[i];
+    if (opt->type == OptionTypeDeprecated) {
+      continue;
+    }
+
+    // One line per schedule rule, since a line can't hold all rules
+    if (opt->type == OptionTypeSchedule) {
+      for (unsigned int j = 0; j < m_schedule.count; j++) {
+        char rule[64];
+        schedule_format_rule(&m_schedule.rules[j], rule, sizeof(rule));
+        len += snprintf(&buf[len], CONFIG_FILE_MAX - len, "%s = %s\n",
+                        opt->key, rule);
+        if (len >= CONFIG_FILE_MAX) {
+          break;
+        }
+      }
+      continue;
+    }
+
+    char value[sizeof(m_tzinfo)];
+    formatOption(opt, value, sizeof(value));
+
+    if (minimal) {
+      char def_value[sizeof(m_tzinfo)];
+      defaults.formatOption(opt, def_value, sizeof(def_value));
+      if (strcmp(value, def_value) == 0) {
+        continue;
+      }
+    }
+
+    len += snprintf(&buf[len], CONFIG_FILE_MAX - len, "%s = %s\n",
+                    opt->key, value);
+  }
+  if (len >= CONFIG_FILE_MAX) {
+    Serial.println("Configuration too large");
+    goto fail;
+  }
+
+  // Write to temporary file first, so the configuration file is never
+  // partially written
+  file = fopen(CONFIG_TMP_PATH, "w");
+  if (file == NULL)  {
+    Serial.println("Unable to open config file for writing");
+    goto fail;
+  }
+  if (fwrite(buf, len, 1, file) != 1 ||
+      fflush(file) != 0 ||
+      fsync(fileno(file)) != 0) {
+    Serial.println("Failed to write config file");
+    fclose(file);
+    goto fail;
+  }
+  if (fclose(file) != 0) {
+    Serial.println("Failed to write config file");
+    goto fail;
+  }
+
+  // Keep previous configuration as backup. FAT can't rename over an existing
+  // file, so there is a moment without configuration file. loadConfig() then
+  // uses the backup.
+  (void) unlink(CONFIG_BAK_PATH);
+  if (rename(CONFIG_PATH, CONFIG_BAK_PATH) != 0 && errno != ENOENT) {
+    Serial.println("Failed to backup config file");
+    goto fail;
+  }
+  if (rename(CONFIG_TMP_PATH, CONFIG_PATH) != 0) {
+    Serial.println("Failed to replace config file");
+    goto fail;
+  }
+
+  retval = true;
+
+fail:
+  free(buf);
+
+  return retval;
 }
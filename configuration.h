@@ -31,10 +31,13 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-#include "WString.h"
+#include "config.h"
 #include "esp_camera.h"
+#include "schedule.h"
 
-#define CONFIG_PATH "/sdcard/camera.cfg"
+#define CONFIG_PATH SDCARD_MOUNT_POINT "/camera.cfg"
+#define CONFIG_TMP_PATH SDCARD_MOUNT_POINT "/camera.tmp"
+#define CONFIG_BAK_PATH SDCARD_MOUNT_POINT "/camera.bak"
 
 class Configuration {
 public:
@@ -54,49 +57,90 @@ public:
     SpecialEffectBlueTint=5,
     SpecialEffectSepia=6
   };
+  enum OutputFormat {
+    OutputFormatJpeg=0,
+    OutputFormatAvi=1
+  };
+  enum BurstSelect {
+    BurstSelectAll=0,
+    BurstSelectBest=1
+  };
+  enum ShardMode {
+    ShardModeNone=0,
+    ShardModeDay=1,
+    ShardModeHour=2,
+    ShardModeCount=3
+  };
+  enum Thumbnail {
+    ThumbnailNone=0,
+    ThumbnailQqvga=1,
+    ThumbnailQvga=2
+  };
+  enum NightMode {
+    NightModeOff=0,
+    NightModeSkip=1,
+    NightModeInterval=2
+  };
+  enum MissedCapture {
+    MissedCaptureCatchUp=0,
+    MissedCaptureSkip=1,
+    MissedCaptureCoalesce=2
+  };
+  enum SleepMode {
+    SleepModeAuto=0,
+    SleepModeDeep=1,
+    SleepModeLight=2,
+    SleepModeNone=3
+  };
 
-  Configuration() :
-    m_capture_interval(5000),
-    m_enable_busy_led(true),
-    m_enable_flash(false),
-    m_training_shots(0),
-    m_tzinfo("GMT0"),
-    m_orientation(1),
-    m_frame_size(FRAMESIZE_UXGA),
-    m_quality(10),
-    m_contrast(0),
-    m_brightness(0),
-    m_saturation(0),
-    m_colorbar(false),
-    m_hmirror(false),
-    m_vflip(false),
-    m_awb(true),
-    m_awb_gain(true),
-    m_wb_mode(WbModeAuto),
-    m_agc(true),
-    m_agc_gain(1),
-    m_gainceiling(GAINCEILING_8X),
-    m_aec(true),
-    m_aec_value(51),
-    m_aec2(true),
-    m_ae_level(0),
-    m_dcw(true),
-    m_bpc(false),
-    m_wpc(true),
-    m_raw_gma(true),
-    m_lenc(true),
-    m_special_effect(SpecialEffectNone)
-  {};
+  Configuration() { setDefaults(); }
 
   bool loadConfig();
-  bool saveConfig();
+  /**
+   * Save configuration to SD card
+   *
+   * The previous configuration file is kept as backup.
+   *
+   * @param minimal	Only write options that differ from the default
+   */
+  bool saveConfig(bool minimal=false);
 
-  String configAsJSON() const;
+  /**
+   * Write configuration as JSON object to buffer
+   *
+   * @param buf	Output buffer, the result is always NUL terminated
+   * @param size	Size of buf
+   *
+   * @returns	Length of the JSON string. If this is >= size, the output was
+   *		truncated.
+   */
+  size_t configAsJSON(char *buf, size_t size) const;
 
   unsigned int getCaptureInterval() const { return m_capture_interval; }
   bool getEnableBusyLed() const { return m_enable_busy_led; }
   bool getEnableFlash() const { return m_enable_flash; }
   unsigned int getTrainingShots() const { return m_training_shots; };
+  unsigned int getTrainingTolerance() const { return m_training_tolerance; }
+  unsigned int getBurstCount() const { return m_burst_count; }
+  BurstSelect getBurstSelect() const { return m_burst_select; }
+  bool getPipeline() const { return m_pipeline; }
+  SleepMode getSleepMode() const { return m_sleep_mode; }
+  OutputFormat getOutputFormat() const { return m_output_format; }
+  ShardMode getShardMode() const { return m_shard_mode; }
+  unsigned int getShardSize() const { return m_shard_size; }
+  bool getPrealloc() const { return m_prealloc; }
+  unsigned int getWriteBufferSize() const { return m_write_buffer_size; }
+  unsigned int getMinFreeSpace() const { return m_min_free_space; }
+  Thumbnail getThumbnail() const { return m_thumbnail; }
+  unsigned int getChangeThreshold() const { return m_change_threshold; }
+  unsigned int getChangeKeyframe() const { return m_change_keyframe; }
+  NightMode getNightMode() const { return m_night_mode; }
+  unsigned int getNightInterval() const { return m_night_interval; }
+  int getNightElevation() const { return m_night_elevation; }
+  int32_t getLatitude() const { return m_latitude; }
+  int32_t getLongitude() const { return m_longitude; }
+  const schedule_t *getSchedule() const { return &m_schedule; }
+  MissedCapture getMissedCapture() const { return m_missed_capture; }
 
   const char *getTzInfo() const { return m_tzinfo; }
 
@@ -133,6 +177,45 @@ public:
   int config_set(const char *key, const char *value);
 
 private:
+  /**
+   * Type of configuration option, determines how the value is parsed and
+   * formatted
+   */
+  enum OptionType {
+    OptionTypeBool,
+    OptionTypeInt, /**< Integer in range [min, max] */
+    OptionTypeEnum, /**< Index in strings table */
+    OptionTypeString, /**< Character array of size bytes */
+    OptionTypeInterval, /**< Integer, values < min are clamped to min */
+    OptionTypeAgcGain, /**< Integer, stored 0-based */
+    OptionTypeRotation, /**< Rotation in degrees, stored as Exif orientation */
+    OptionTypeFrameSize, /**< Frame size name or resolution */
+    OptionTypeDegrees, /**< Decimal degrees, stored in millionths of a degree */
+    OptionTypeSchedule, /**< Schedule rules, every value appends rules */
+    OptionTypeDeprecated /**< Ignored option */
+  };
+
+  /**
+   * Configuration option schema entry
+   */
+  struct Option {
+    const char *key;
+    OptionType type;
+    uint16_t offset; /**< Offset of member in Configuration */
+    uint8_t size; /**< Size of member */
+    int32_t min;
+    int32_t max;
+    int32_t def; /**< Default value, as stored in member */
+    const char * const *strings; /**< Enum value strings */
+    const char *def_str; /**< Default value of string options */
+  };
+
+  static const Option options[];
+  static const Option *findOption(const char *key);
+
+  void setDefaults();
+  int formatOption(const Option *opt, char *buf, size_t size) const;
+
   // Generic options
   unsigned int m_capture_interval;
         /**< Microseconds between captures.
@@ -144,6 +227,47 @@ private:
         /* Enable Flash LED when taking a picture */
   unsigned int m_training_shots;
         /* Amount of images to take before the real shot to train the AGC/AWB */
+  unsigned int m_training_tolerance;
+        /* Stop training once exposure changes less than this percentage */
+  unsigned int m_burst_count;
+        /* Amount of images to take every capture interval */
+  BurstSelect m_burst_select;
+        /* Keep all images of a burst, or only the best one */
+  bool m_pipeline;
+        /* Write images to SD card from a separate task while capturing */
+  SleepMode m_sleep_mode;
+        /* Which sleep modes may be used in between captures */
+  OutputFormat m_output_format;
+        /* Store images as separate JPEG files, or append them to an AVI */
+  ShardMode m_shard_mode;
+        /* How to divide images over subdirectories of the capture directory */
+  unsigned int m_shard_size;
+        /* Amount of images per subdirectory if m_shard_mode is count */
+  bool m_prealloc;
+        /* Allocate the file's clusters before writing an image */
+  unsigned int m_write_buffer_size;
+        /* stdio buffer size used for writing images, 0 for default */
+  unsigned int m_min_free_space;
+        /* Delete oldest images if less MB free on the SD card, 0 to disable */
+  Thumbnail m_thumbnail;
+        /* Size of the thumbnail embedded in the Exif header */
+  unsigned int m_change_threshold;
+        /* Percentage of the scene that must change to store an image, 0 to
+         * store every image */
+  unsigned int m_change_keyframe;
+        /* Store an image at least every this many intervals, 0 for never */
+  NightMode m_night_mode;
+        /* Skip captures at night, or use a longer interval */
+  unsigned int m_night_interval;
+        /* Milliseconds between captures at night if m_night_mode is interval */
+  int m_night_elevation;
+        /* Sun elevation in degrees below which it is night */
+  int32_t m_latitude; /**< Millionths of a degree, north is positive */
+  int32_t m_longitude; /**< Millionths of a degree, east is positive */
+  schedule_t m_schedule;
+        /* Capture schedule rules, the capture interval is used if empty */
+  MissedCapture m_missed_capture;
+        /* What to do with capture times that passed before they were taken */
 
   char m_tzinfo[65]; /**< Timezone spec, see POSIX TZ(5) environment variable */
 
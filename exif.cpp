@@ -27,10 +27,15 @@
  */
 #include "config.h"
 
+#include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <sys/time.h>
+#include "esp_heap_caps.h"
 
 #include "exif.h"
+#include "camera.h"
+#include "jpeg.h"
 #include "exif_defines.h"
 
 // TIFF header byte order
@@ -59,6 +64,16 @@ typedef struct {
 } TiffRational;
 #pragma pack()
 
+/**
+ * Type for storing Tiff Signed Rational typed data
+ */
+#pragma pack(1)
+typedef struct {
+  int32_t num;
+  int32_t denom;
+} TiffSRational;
+#pragma pack()
+
 /**
  * Type used for IFD entries
  *
@@ -108,11 +123,14 @@ typedef struct {
 #endif
 
 // Amount of entries in the Exif private IFD
-#define IFD_EXIF_ENTRY_CNT 6
+#define IFD_EXIF_ENTRY_CNT 10
 
 // Amount of entries in the GPS private IFD
 #define IFD_GPS_ENTRY_CNT 12
 
+// Amount of entries in the 1st IFD, describing the thumbnail
+#define IFD1_ENTRY_CNT 6
+
 // Camera maker string
 #define CAMERA_MAKE "OmniVision"
 
@@ -125,11 +143,16 @@ typedef struct {
 // GPS map datum, probably always 'WGS-84'
 #define GPS_MAP_DATUM "WGS-84"
 
+// Maker note identifier, followed by the sensor register address/value pairs
+#define MAKER_NOTE_ID "OV2640"
+
 /**
  * New Jpeg/Exif header
  *
  * This defines the new JPEG/Exif header that is added to the images. To keep
- * it simple, the structure of the header is completely static.
+ * it simple, the structure of the header is completely static. The 1st IFD
+ * is only included if the image has a thumbnail, the thumbnail JPEG directly
+ * follows the header.
  */
 #pragma pack(1)
 struct JpegExifHdr {
@@ -161,6 +184,14 @@ struct JpegExifHdr {
       IfdEntry entries[IFD_EXIF_ENTRY_CNT];
       uint32_t next_ifd; // Offset of next IFD, or 0x0 if last IFD
     } ifd_exif;
+    struct {
+      TiffRational exposure_time;
+      TiffSRational brightness;
+      struct {
+        char id[sizeof(MAKER_NOTE_ID)];
+        uint8_t regs[CAMERA_REG_DUMP_CNT][2];
+      } maker_note;
+    } ifd_exif_data;
 #ifdef WITH_GNSS
     struct {
       uint16_t cnt; // amount of entries
@@ -177,11 +208,16 @@ struct JpegExifHdr {
       char date_stamp[11];
     } ifd_gps_data;
 #endif //WITH_GNSS
+    struct {
+      uint16_t cnt; // amount of entries
+      IfdEntry entries[IFD1_ENTRY_CNT];
+      uint32_t next_ifd; // Offset of next IFD, or 0x0 if last IFD
+    } ifd1;
   } tiff_data;
 } exif_hdr = {
   htons_macro(0xffd8),
   htons_macro(0xffe1),
-  htons_macro(sizeof(JpegExifHdr) - offsetof(JpegExifHdr, len)),
+  htons_macro(offsetof(JpegExifHdr, tiff_data.ifd1) - offsetof(JpegExifHdr, len)),
   { 'E', 'x', 'i', 'f', 0, 0 },
   {
     .tiff_hdr = { TIFF_BYTE_ORDER, 0x002A, 0x8 },
@@ -241,20 +277,34 @@ struct JpegExifHdr {
     .ifd_exif = {
       .cnt = IFD_EXIF_ENTRY_CNT,
       .entries = {
+        { TagExifExposureTime,
+          TiffTypeRational, 1,
+          IFD_SET_OFFSET(JpegExifHdr::TiffData, ifd_exif_data.exposure_time) },
+#define TAG_EXIF_ISO_SPEED_RATINGS_IDX 1
+        { TagExifPhotographicSensitivity,
+          TiffTypeShort, 1,
+          IFD_SET_SHORT(0) },
         { TagExifVersion,
           TiffTypeUndef, 4,
           IFD_SET_UNDEF(0x30, 0x32, 0x33, 0x30) },
         { TagExifComponentsConfiguration,
           TiffTypeUndef, 4,
           IFD_SET_UNDEF(0x01, 0x02, 0x03, 0x00) },
-#define TAG_EXIF_SUBSEC_TIME_IDX 2
+        { TagExifBrightnessValue,
+          TiffTypeSRational, 1,
+          IFD_SET_OFFSET(JpegExifHdr::TiffData, ifd_exif_data.brightness) },
+        { TagExifMakerNote,
+          TiffTypeUndef,
+          sizeof(exif_hdr.tiff_data.ifd_exif_data.maker_note),
+          IFD_SET_OFFSET(JpegExifHdr::TiffData, ifd_exif_data.maker_note) },
+#define TAG_EXIF_SUBSEC_TIME_IDX 6
         { TagExifSubSecTime,
           TiffTypeAscii, 4,
           IFD_SET_UNDEF(0x20, 0x20, 0x20, 0x00) },
         { TagExifColorSpace,
           TiffTypeShort, 1,
           IFD_SET_SHORT(1) },
-#define TAG_EXIF_PIXEL_X_DIMENSION_IDX 4
+#define TAG_EXIF_PIXEL_X_DIMENSION_IDX 8
         { TagExifPixelXDimension,
           TiffTypeShort, 1,
           IFD_SET_SHORT(1600) },
@@ -265,6 +315,11 @@ struct JpegExifHdr {
       },
       .next_ifd = 0
     },
+    .ifd_exif_data = {
+      { 0, 1000000 },
+      { 0, 100 },
+      { MAKER_NOTE_ID, {} },
+    },
 #ifdef WITH_GNSS
     .ifd_gps = {
       .cnt = IFD_GPS_ENTRY_CNT,
@@ -327,12 +382,40 @@ struct JpegExifHdr {
       GPS_MAP_DATUM,
       { 0x41, 0x53, 0x43, 0x49, 0x49, 0x00, 0x00, 0x00, 'G', 'P', 'S' },
       "    :  :  ",
-    }
+    },
 #endif // WITH_GNSS
+    .ifd1 = {
+      .cnt = IFD1_ENTRY_CNT,
+      .entries = {
+        { TagTiffCompression,
+          TiffTypeShort, 1,
+          IFD_SET_SHORT(6) },
+        { TagTiffXResolution,
+          TiffTypeRational, 1,
+          IFD_SET_OFFSET(JpegExifHdr::TiffData, ifd0_data) },
+        { TagTiffYResolution,
+          TiffTypeRational, 1,
+          IFD_SET_OFFSET(JpegExifHdr::TiffData, ifd0_data) },
+        { TagTiffResolutionUnit,
+          TiffTypeShort, 1,
+          IFD_SET_SHORT(0x0002) },
+        { TagTiffJPEGInterchangeFormat,
+          TiffTypeLong, 1,
+          IFD_SET_LONG(sizeof(JpegExifHdr::TiffData)) },
+#define TAG_IFD1_JPEG_LENGTH_IDX 5
+        { TagTiffJPEGInterchangeFormatLength,
+          TiffTypeLong, 1,
+          IFD_SET_LONG(0) },
+      },
+      .next_ifd = 0
+    }
   }
 };
 #pragma pack()
 
+// Buffer holding a copy of the Exif header followed by the thumbnail
+static uint8_t *exif_thumb_buf = NULL;
+
 bool update_exif_from_cfg(const Configuration &c)
 {
   exif_hdr.tiff_data.ifd0.entries[TAG_IFD0_ORIENTATION_IDX].value = IFD_SET_SHORT(c.getOrientation());
@@ -399,7 +482,8 @@ void update_exif_gps(const MicroNMEA& nmea)
 }
 #endif // WITH_GNSS
 
-const uint8_t *get_exif_header(camera_fb_t *fb, const uint8_t **exif_buf, size_t *exif_len)
+const uint8_t *get_exif_header(camera_fb_t *fb, const struct timeval *tv,
+                               const uint8_t **exif_buf, size_t *exif_len)
 {
   // TODO: pass config to function and use that to set some of the image
   // taking conditions. Or do this only once, with a update config
@@ -407,7 +491,9 @@ const uint8_t *get_exif_header(camera_fb_t *fb, const uint8_t **exif_buf, size_t
 
   // Get current time
   struct timeval now_tv;
-  if (gettimeofday(&now_tv, NULL) != 0) {
+  if (tv != NULL) {
+    now_tv = *tv;
+  } else if (gettimeofday(&now_tv, NULL) != 0) {
     now_tv.tv_sec = time(NULL);
     now_tv.tv_usec = 0;
   }
@@ -423,40 +509,66 @@ const uint8_t *get_exif_header(camera_fb_t *fb, const uint8_t **exif_buf, size_t
   snprintf(
       (char *) &(exif_hdr.tiff_data.ifd_exif.entries[TAG_EXIF_SUBSEC_TIME_IDX].value),
       4,
-      "%03ld",
-      now_tv.tv_usec/1000);
+      "%03u",
+      (unsigned int) (now_tv.tv_usec / 1000) % 1000);
 
   // Update image dimensions
   exif_hdr.tiff_data.ifd_exif.entries[TAG_EXIF_PIXEL_X_DIMENSION_IDX].value = IFD_SET_SHORT(fb->width);
   exif_hdr.tiff_data.ifd_exif.entries[TAG_EXIF_PIXEL_Y_DIMENSION_IDX].value = IFD_SET_SHORT(fb->height);
 
-  *exif_len = sizeof(exif_hdr);
+  // Update exposure information
+  camera_frame_info_t info;
+  if (!camera_get_frame_info(fb, &info)) {
+    memset(&info, 0, sizeof(info));
+  }
+  exif_hdr.tiff_data.ifd_exif_data.exposure_time.num = info.exposure_us;
+  exif_hdr.tiff_data.ifd_exif_data.brightness.num = info.brightness;
+  exif_hdr.tiff_data.ifd_exif.entries[TAG_EXIF_ISO_SPEED_RATINGS_IDX].value = IFD_SET_SHORT(info.iso);
+  memcpy(exif_hdr.tiff_data.ifd_exif_data.maker_note.regs, info.regs,
+         sizeof(info.regs));
+
+  // Attach thumbnail
+  const uint8_t *thumb = NULL;
+  size_t thumb_len = 0;
+  if (camera_get_thumbnail(fb, &thumb, &thumb_len) &&
+      exif_thumb_buf == NULL) {
+    exif_thumb_buf = (uint8_t *) heap_caps_malloc(
+        sizeof(exif_hdr) + CAMERA_THUMBNAIL_MAX, MALLOC_CAP_SPIRAM);
+  }
+  if (thumb_len == 0 || thumb_len > CAMERA_THUMBNAIL_MAX ||
+      exif_thumb_buf == NULL) {
+    // Leave out the 1st IFD
+    size_t len = offsetof(JpegExifHdr, tiff_data.ifd1);
+    exif_hdr.len = htons_macro(len - offsetof(JpegExifHdr, len));
+    exif_hdr.tiff_data.ifd0.next_ifd = 0;
+
+    *exif_len = len;
+    if (exif_buf != NULL) {
+      *exif_buf = (uint8_t *) &exif_hdr;
+    }
+    return (uint8_t *) &exif_hdr;
+  }
+
+  exif_hdr.len = htons_macro(sizeof(exif_hdr) + thumb_len -
+                             offsetof(JpegExifHdr, len));
+  exif_hdr.tiff_data.ifd0.next_ifd =
+    IFD_SET_OFFSET(JpegExifHdr::TiffData, ifd1);
+  exif_hdr.tiff_data.ifd1.entries[TAG_IFD1_JPEG_LENGTH_IDX].value =
+    IFD_SET_LONG(thumb_len);
+
+  memcpy(exif_thumb_buf, &exif_hdr, sizeof(exif_hdr));
+  memcpy(exif_thumb_buf + sizeof(exif_hdr), thumb, thumb_len);
 
+  *exif_len = sizeof(exif_hdr) + thumb_len;
   if (exif_buf != NULL) {
-    *exif_buf = (uint8_t *) &exif_hdr;
+    *exif_buf = exif_thumb_buf;
   }
-
-  return (uint8_t *) &exif_hdr;
+  return exif_thumb_buf;
 }
 
 size_t get_jpeg_data_offset(camera_fb_t *fb)
 {
-  if (fb->len < 6) {
-    return 0;
-  }
-
-  // Check JPEG SOI
-  if (fb->buf[0] != 0xff || fb->buf[1] != 0xd8) {
-    return 0;
-  }
-  size_t data_offset = 2; // Offset to first JPEG segment after header
-
-  // Check if JFIF header
-  if (fb->buf[2] == 0xff && fb->buf[3] == 0xe0) {
-    uint16_t jfif_len = fb->buf[4] << 8 | fb->buf[5];
-
-    data_offset += 2 + jfif_len;
-  }
+  size_t data_offset = jpeg_skip_headers(fb->buf, fb->len);
 
   if (data_offset >= fb->len) {
     return 0;
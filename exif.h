@@ -30,6 +30,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/time.h>
 #include "esp_camera.h"
 #include "configuration.h"
 #ifdef WITH_GNSS
@@ -62,23 +63,29 @@ void update_exif_gps(const MicroNMEA& nmea);
  * The JPEG does need to be stripped from its original header first, see
  * get_jpeg_data_offset().
  *
+ * If a thumbnail was captured together with the image, it is embedded in the
+ * header. The size of the header thus differs per image.
+ *
  * The returned pointer point so a static buffer, and should not be altered.
  * This function is not reentrant safe.
  *
  * @param fb		Frame buffer of captured image. Encoding is expected to
  *                      be JPEG
+ * @param tv		Capture time of the image, or NULL to use current time
  * @param exif_buf	If not NULL, used to return pointer to Exif buffer in
  * @param exif_buf	Used to return the size of the Exif buffer
  *
  * @returns		Pointer to Exif buffer, or NULL on error
  */
-const uint8_t *get_exif_header(camera_fb_t *fb, const uint8_t **exif_buf, size_t *exif_len);
+const uint8_t *get_exif_header(camera_fb_t *fb, const struct timeval *tv,
+                               const uint8_t **exif_buf, size_t *exif_len);
 
 /**
  * Get offset of first none header byte in buffer
  *
  * Get the offset of the first none JPEG header byte in capture buffer. This
- * can be used to strip the JPEG SOI and JFIF headers from an image.
+ * can be used to strip the JPEG SOI and any APPn/COM segments, like the JFIF
+ * header, from an image.
  *
  * @returns	offset of first non header byte, or 0 on error
  */
@@ -0,0 +1,220 @@
+/**
+ * jpeg.cpp - JPEG stream validation
+ *
+ * Copyright (c) 2019, David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <string.h>
+
+#include "jpeg.h"
+
+// JPEG markers
+#define JPEG_MARKER_TEM 0x01
+#define JPEG_MARKER_RST0 0xd0
+#define JPEG_MARKER_RST7 0xd7
+#define JPEG_MARKER_SOI 0xd8
+#define JPEG_MARKER_EOI 0xd9
+#define JPEG_MARKER_SOS 0xda
+#define JPEG_MARKER_APP0 0xe0
+#define JPEG_MARKER_APP15 0xef
+#define JPEG_MARKER_COM 0xfe
+
+static inline bool is_standalone_marker(uint8_t marker)
+{
+  return marker == JPEG_MARKER_TEM ||
+         (marker >= JPEG_MARKER_RST0 && marker <= JPEG_MARKER_RST7);
+}
+
+static inline bool is_header_marker(uint8_t marker)
+{
+  return marker == JPEG_MARKER_COM ||
+         (marker >= JPEG_MARKER_APP0 && marker <= JPEG_MARKER_APP15);
+}
+
+/**
+ * Read marker at *pos
+ *
+ * Skips any fill bytes in front of the marker.
+ *
+ * @returns	Marker, or -1 if there is no marker at *pos
+ */
+static int read_marker(const uint8_t *buf, size_t len, size_t *pos)
+{
+  if (*pos >= len || buf[*pos] != 0xff) {
+    return -1;
+  }
+
+  while (*pos < len && buf[*pos] == 0xff) {
+    (*pos)++;
+  }
+  if (*pos >= len) {
+    return -1;
+  }
+
+  return buf[(*pos)++];
+}
+
+/**
+ * Skip segment payload, *pos must point to the segment length field
+ *
+ * @returns	True on success, false if the segment is truncated
+ */
+static bool skip_segment(const uint8_t *buf, size_t len, size_t *pos)
+{
+  if (len - *pos < 2) {
+    return false;
+  }
+
+  size_t seg_len = buf[*pos] << 8 | buf[*pos + 1];
+  if (seg_len < 2 || len - *pos < seg_len) {
+    return false;
+  }
+  *pos += seg_len;
+
+  return true;
+}
+
+/**
+ * Skip entropy coded data, until the next marker
+ *
+ * @returns	True on success, false if the end of the buffer is reached
+ */
+static bool skip_entropy_coded_data(const uint8_t *buf, size_t len,
+                                    size_t *pos)
+{
+  while (*pos < len) {
+    const uint8_t *p = (const uint8_t *) memchr(&buf[*pos], 0xff, len - *pos);
+    if (p == NULL || p + 1 >= buf + len) {
+      return false;
+    }
+    *pos = p - buf;
+
+    // Byte stuffing, restart markers and fill bytes are part of the data
+    uint8_t next = p[1];
+    if (next == 0x00 || next == 0xff ||
+        (next >= JPEG_MARKER_RST0 && next <= JPEG_MARKER_RST7)) {
+      *pos += (next == 0xff) ? 1 : 2;
+      continue;
+    }
+
+    return true;
+  }
+
+  return false;
+}
+
+jpeg_status_t jpeg_parse(const uint8_t *buf, size_t len, jpeg_info_t *info)
+{
+  size_t pos = 2;
+  bool in_header = true;
+  bool have_sos = false;
+
+  info->data_offset = 0;
+  info->len = 0;
+
+  if (len < 4 || buf[0] != 0xff || buf[1] != JPEG_MARKER_SOI) {
+    return info->status = JPEG_ERR_NO_SOI;
+  }
+
+  while (true) {
+    size_t marker_pos = pos;
+    int marker = read_marker(buf, len, &pos);
+    if (marker < 0) {
+      return info->status = (pos >= len) ? JPEG_ERR_NO_EOI : JPEG_ERR_CORRUPT;
+    }
+
+    if (marker == JPEG_MARKER_EOI) {
+      if (!have_sos) {
+        return info->status = JPEG_ERR_NO_SOS;
+      }
+      info->len = pos;
+      return info->status = JPEG_OK;
+    }
+
+    if (is_standalone_marker(marker)) {
+      continue;
+    }
+
+    if (in_header && !is_header_marker(marker)) {
+      info->data_offset = marker_pos;
+      in_header = false;
+    }
+
+    if (!skip_segment(buf, len, &pos)) {
+      return info->status = JPEG_ERR_TRUNCATED;
+    }
+
+    if (marker == JPEG_MARKER_SOS) {
+      have_sos = true;
+      if (!skip_entropy_coded_data(buf, len, &pos)) {
+        return info->status = JPEG_ERR_NO_EOI;
+      }
+    }
+  }
+}
+
+size_t jpeg_skip_headers(const uint8_t *buf, size_t len)
+{
+  size_t pos = 2;
+
+  if (len < 4 || buf[0] != 0xff || buf[1] != JPEG_MARKER_SOI) {
+    return 0;
+  }
+
+  while (true) {
+    size_t marker_pos = pos;
+    int marker = read_marker(buf, len, &pos);
+    if (marker < 0) {
+      return 0;
+    }
+
+    if (!is_header_marker(marker)) {
+      return marker_pos;
+    }
+
+    if (!skip_segment(buf, len, &pos)) {
+      return 0;
+    }
+  }
+}
+
+const char *jpeg_strerror(jpeg_status_t status)
+{
+  switch (status) {
+  case JPEG_OK:
+    return "OK";
+  case JPEG_ERR_NO_SOI:
+    return "No SOI marker";
+  case JPEG_ERR_CORRUPT:
+    return "Corrupt marker";
+  case JPEG_ERR_TRUNCATED:
+    return "Truncated segment";
+  case JPEG_ERR_NO_SOS:
+    return "No SOS marker";
+  case JPEG_ERR_NO_EOI:
+    return "No EOI marker";
+  default:
+    return "Unknown error";
+  }
+}
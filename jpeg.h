@@ -0,0 +1,84 @@
+/**
+ * jpeg.h - JPEG stream validation
+ *
+ * Copyright (c) 2019, David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __JPEG_H__
+#define __JPEG_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Result of JPEG stream validation
+ */
+typedef enum {
+  JPEG_OK = 0,
+  JPEG_ERR_NO_SOI, /**< Doesn't start with Start Of Image marker */
+  JPEG_ERR_CORRUPT, /**< Marker expected but not found */
+  JPEG_ERR_TRUNCATED, /**< Segment extends beyond end of buffer */
+  JPEG_ERR_NO_SOS, /**< End of image before Start Of Scan */
+  JPEG_ERR_NO_EOI /**< No End Of Image marker, image is truncated */
+} jpeg_status_t;
+
+/**
+ * JPEG stream information
+ */
+typedef struct {
+  jpeg_status_t status;
+  size_t data_offset; /**< Offset of first segment after SOI and APPn/COM */
+  size_t len; /**< Length of stream up to and including EOI */
+} jpeg_info_t;
+
+/**
+ * Validate JPEG stream
+ *
+ * Walks all markers of the stream, without reading past len. Checks that the
+ * stream starts with SOI, contains a SOS segment and ends with EOI. Any data
+ * after EOI is not part of the stream, and is excluded from info->len.
+ *
+ * @param buf	JPEG stream
+ * @param len	Size of buf
+ * @param info	Used to return stream information
+ *
+ * @returns	info->status
+ */
+jpeg_status_t jpeg_parse(const uint8_t *buf, size_t len, jpeg_info_t *info);
+
+/**
+ * Get offset of first segment after SOI and any APPn/COM segments
+ *
+ * Only walks the header segments, the stream is not validated.
+ *
+ * @returns	Offset, or 0 on error
+ */
+size_t jpeg_skip_headers(const uint8_t *buf, size_t len);
+
+/**
+ * Get description of JPEG status code
+ */
+const char *jpeg_strerror(jpeg_status_t status);
+
+#endif // __JPEG_H__
@@ -0,0 +1,214 @@
+/**
+ * pipeline.cpp - Overlap image capture with writing to SD card
+ *
+ * Copyright (c) 2019, David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+
+#include "Arduino.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include <string.h>
+#include <sys/time.h>
+
+#include "pipeline.h"
+
+// Amount of captured frames that can wait for the writer. With two frame
+// buffers one frame is being written while the other is being captured, so
+// there is no use in queuing more frames than this.
+#define PIPELINE_QUEUE_LEN 1
+
+// Writer task parameters
+// The writer runs the whole write path: Exif and thumbnail header
+// generation, reclaiming space on the SD card and finalizing AVI files.
+#define PIPELINE_TASK_STACK_SIZE 8192
+#define PIPELINE_TASK_PRIORITY 1
+#define PIPELINE_TASK_CORE 0
+
+// Print timing statistics every this many frames
+#define PIPELINE_STATS_INTERVAL 10
+
+typedef struct {
+  camera_fb_t *fb;
+  struct timeval tv;
+} pipeline_frame_t;
+
+static QueueHandle_t s_queue = NULL;
+static TaskHandle_t s_task = NULL;
+static pipeline_write_cb_t s_write_cb = NULL;
+
+// Only written by the producer
+static volatile uint32_t s_submitted = 0;
+// Only written by the writer task
+static volatile uint32_t s_completed = 0;
+
+// Magic value to detect valid timing counters in RTC memory
+#define PIPELINE_STATS_MAGIC 0x50495030
+
+/**
+ * Per stage timing counters in RTC memory
+ *
+ * Kept over deep sleep, so the frames of all wake-ups are accounted. Every
+ * counter is only updated by a single task.
+ */
+RTC_DATA_ATTR static struct {
+  uint32_t magic;
+  uint32_t frames;
+  uint64_t capture_us;
+  uint32_t capture_max_us;
+  uint64_t queue_us;
+  uint64_t write_us;
+  uint32_t write_max_us;
+  struct timeval first_frame; /**< Time the first frame was written */
+} s_stats;
+
+/**
+ * Reset timing counters if RTC memory was lost
+ *
+ * Called by the capturing task, before the frame is submitted or written.
+ */
+static void stats_validate()
+{
+  if (s_stats.magic != PIPELINE_STATS_MAGIC) {
+    memset(&s_stats, 0, sizeof(s_stats));
+    s_stats.magic = PIPELINE_STATS_MAGIC;
+  }
+}
+
+static void pipeline_writer_task(void *arg)
+{
+  pipeline_frame_t frame;
+
+  while (true) {
+    if (xQueueReceive(s_queue, &frame, portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+
+    s_write_cb(frame.fb, &frame.tv);
+    s_completed = s_completed + 1;
+  }
+}
+
+bool pipeline_init(pipeline_write_cb_t write_cb)
+{
+  s_write_cb = write_cb;
+
+  s_queue = xQueueCreate(PIPELINE_QUEUE_LEN, sizeof(pipeline_frame_t));
+  if (s_queue == NULL) {
+    Serial.println("Unable to create pipeline queue");
+    return false;
+  }
+
+  if (xTaskCreatePinnedToCore(pipeline_writer_task, "writer",
+                              PIPELINE_TASK_STACK_SIZE, NULL,
+                              PIPELINE_TASK_PRIORITY, &s_task,
+                              PIPELINE_TASK_CORE) != pdPASS) {
+    Serial.println("Unable to create pipeline writer task");
+    return false;
+  }
+
+  Serial.println("Capture pipeline enabled");
+
+  return true;
+}
+
+bool pipeline_submit(camera_fb_t *fb, const struct timeval *tv)
+{
+  pipeline_frame_t frame = { fb, *tv };
+
+  unsigned long start = micros();
+  s_submitted = s_submitted + 1;
+  if (xQueueSend(s_queue, &frame, portMAX_DELAY) != pdTRUE) {
+    s_submitted = s_submitted - 1;
+    return false;
+  }
+  s_stats.queue_us += micros() - start;
+
+  return true;
+}
+
+void pipeline_flush()
+{
+  if (s_queue == NULL) {
+    return;
+  }
+
+  while (s_completed != s_submitted) {
+    vTaskDelay(1);
+  }
+}
+
+void pipeline_stats_capture(uint32_t usec)
+{
+  stats_validate();
+
+  s_stats.capture_us += usec;
+  if (usec > s_stats.capture_max_us) {
+    s_stats.capture_max_us = usec;
+  }
+}
+
+void pipeline_stats_write(uint32_t usec)
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+
+  if (s_stats.frames == 0) {
+    s_stats.first_frame = now;
+  }
+
+  s_stats.frames++;
+  s_stats.write_us += usec;
+  if (usec > s_stats.write_max_us) {
+    s_stats.write_max_us = usec;
+  }
+
+  if (s_stats.frames % PIPELINE_STATS_INTERVAL != 0) {
+    return;
+  }
+
+  uint32_t frames = s_stats.frames;
+  struct timeval elapsed;
+  timersub(&now, &s_stats.first_frame, &elapsed);
+  unsigned long elapsed_ms = elapsed.tv_sec * 1000UL + elapsed.tv_usec / 1000;
+  Serial.printf("Stats: %u frames in %lu ms; "
+                "capture avg. %lu us (max %u); "
+                "queue avg. %lu us; "
+                "write avg. %lu us (max %u)\n",
+                frames, elapsed_ms,
+                (unsigned long) (s_stats.capture_us / frames),
+                s_stats.capture_max_us,
+                (unsigned long) (s_stats.queue_us / frames),
+                (unsigned long) (s_stats.write_us / frames),
+                s_stats.write_max_us);
+
+  // Smallest amount of stack left unused by the writer task, in bytes
+  if (s_task != NULL) {
+    Serial.printf("Stats: writer stack min. free %u of %u bytes\n",
+                  (unsigned int) uxTaskGetStackHighWaterMark(s_task),
+                  PIPELINE_TASK_STACK_SIZE);
+  }
+}
@@ -0,0 +1,84 @@
+/**
+ * pipeline.h - Overlap image capture with writing to SD card
+ *
+ * Copyright (c) 2019, David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include <sys/time.h>
+#include "esp_camera.h"
+
+/**
+ * pipeline write callback function signature.
+ *
+ * Called from the writer task for every submitted frame. The callback takes
+ * ownership of the frame buffer, and must return it to the camera driver.
+ */
+typedef void (*pipeline_write_cb_t)(camera_fb_t *fb, const struct timeval *tv);
+
+/**
+ * Start capture pipeline
+ *
+ * Creates the frame queue and the writer task. Frames submitted with
+ * pipeline_submit() are passed to write_cb from the writer task, so the
+ * caller can capture the next frame while the previous one is being written.
+ *
+ * @returns	True on success, else false
+ */
+bool pipeline_init(pipeline_write_cb_t write_cb);
+
+/**
+ * Queue frame for writing
+ *
+ * Blocks if the queue is full.
+ *
+ * @param fb	Captured frame, ownership is passed to the pipeline
+ * @param tv	Capture time of the frame
+ *
+ * @returns	True on success, else false
+ */
+bool pipeline_submit(camera_fb_t *fb, const struct timeval *tv);
+
+/**
+ * Wait till all submitted frames are written
+ *
+ * Must be called before going to sleep or de-initializing the camera.
+ */
+void pipeline_flush();
+
+/**
+ * Account time spent capturing a frame
+ */
+void pipeline_stats_capture(uint32_t usec);
+
+/**
+ * Account time spent writing a frame
+ *
+ * Prints the accumulated per stage timing every PIPELINE_STATS_INTERVAL frames.
+ */
+void pipeline_stats_write(uint32_t usec);
+
+#endif // __PIPELINE_H__
@@ -0,0 +1,599 @@
+/**
+ * schedule.cpp - Capture scheduling
+ *
+ * Copyright (c) 2019, David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+
+#include "Arduino.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "configuration.h"
+#include "schedule.h"
+
+// Unix time of the J2000 epoch, 2000-01-01 12:00 UTC
+#define J2000_UNIX_TIME 946728000L
+
+#define DAY_SEC 86400L
+
+// Maximum amount of days to search for the next dawn, i.e. during polar night
+#define DAWN_SEARCH_DAYS 190
+
+#define DEG_TO_RAD(x) ((x) * M_PI / 180)
+
+// Maximum amount of times to move a capture out of the night
+#define NIGHT_SKIP_MAX 8
+
+// Weekday names, indexed by struct tm's tm_wday
+static const char *day_names[] = {
+  "sun", "mon", "tue", "wed", "thu", "fri", "sat"
+};
+
+/**
+ * Compute sunrise and sunset
+ *
+ * Implements the sunrise equation, which is accurate to about a minute. The
+ * sun rises and sets when crossing the configured night elevation.
+ *
+ * @param day	Solar day, in days since J2000
+ * @param transit	Used to return the solar noon
+ * @param rise	Used to return the time the sun rises
+ * @param set	Used to return the time the sun sets
+ *
+ * @returns	0 if the sun rises and sets, -1 if the sun stays below the night
+ *		elevation all day, 1 if it stays above.
+ */
+static int sun_rise_set(long day, time_t *transit, time_t *rise, time_t *set)
+{
+  double lat = DEG_TO_RAD(cfg.getLatitude() / 1e6);
+  double lon = cfg.getLongitude() / 1e6;
+  double elevation = DEG_TO_RAD(cfg.getNightElevation());
+
+  // Mean solar noon
+  double j = day - lon / 360;
+  // Solar mean anomaly
+  double m = DEG_TO_RAD(fmod(357.5291 + 0.98560028 * j, 360));
+  // Equation of the center
+  double c = 1.9148 * sin(m) + 0.0200 * sin(2 * m) + 0.0003 * sin(3 * m);
+  // Ecliptic longitude
+  double l = fmod(m + DEG_TO_RAD(c + 180 + 102.9372), 2 * M_PI);
+  // Solar transit
+  double j_transit = j + 0.0053 * sin(m) - 0.0069 * sin(2 * l);
+  // Declination of the sun
+  double sin_d = sin(l) * sin(DEG_TO_RAD(23.4397));
+  double cos_d = cos(asin(sin_d));
+  // Hour angle
+  double cos_h = (sin(elevation) - sin(lat) * sin_d) / (cos(lat) * cos_d);
+
+  *transit = J2000_UNIX_TIME + lround(j_transit * DAY_SEC);
+  if (cos_h > 1) {
+    return -1;
+  } else if (cos_h < -1) {
+    return 1;
+  }
+
+  long h = lround(acos(cos_h) / (2 * M_PI) * DAY_SEC);
+  *rise = *transit - h;
+  *set = *transit + h;
+
+  return 0;
+}
+
+/**
+ * Check if it is night
+ *
+ * @param t	Time to check
+ * @param dawn	Used to return the end of the night, if it is night
+ *
+ * @returns	True if the sun is below the night elevation at time t
+ */
+static bool is_night(time_t t, time_t *dawn)
+{
+  double lon = cfg.getLongitude() / 1e6;
+  // Solar day with the solar noon closest to t
+  long day = lround((double) (t - J2000_UNIX_TIME) / DAY_SEC + lon / 360);
+  time_t transit, rise, set;
+  int res;
+
+  res = sun_rise_set(day, &transit, &rise, &set);
+  if (res > 0 || (res == 0 && t >= rise && t < set)) {
+    return false;
+  }
+  if (res == 0 && t < rise) {
+    *dawn = rise;
+    return true;
+  }
+
+  // After sunset, or polar night: find next sunrise
+  for (long i = 1; i <= DAWN_SEARCH_DAYS; i++) {
+    res = sun_rise_set(day + i, &transit, &rise, &set);
+    if (res == 0) {
+      *dawn = rise;
+      return true;
+    } else if (res > 0) {
+      // Sun never sets that day, so it rose somewhere in the night before
+      *dawn = transit - DAY_SEC / 2;
+      return true;
+    }
+  }
+
+  // Check again tomorrow
+  *dawn = t + DAY_SEC;
+  return true;
+}
+
+/**
+ * Parse weekday name
+ *
+ * @returns	Weekday as in struct tm's tm_wday, or -1 if invalid
+ */
+static int parse_day(const char *str, size_t len)
+{
+  for (int i = 0; i < 7; i++) {
+    if (len == 3 && strncasecmp(str, day_names[i], 3) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Parse list of weekdays and weekday ranges
+ *
+ * @returns	Bitmask of weekdays, bit 0 is Sunday, or 0 if invalid
+ */
+static uint8_t parse_days(const char *str)
+{
+  uint8_t days = 0;
+
+  if (strcmp(str, "*") == 0) {
+    return 0x7f;
+  }
+
+  while (*str != '\0') {
+    size_t len = strcspn(str, ",");
+    const char *dash = (const char *) memchr(str, '-', len);
+    int first, last;
+
+    if (dash != NULL) {
+      first = parse_day(str, dash - str);
+      last = parse_day(dash + 1, len - (dash + 1 - str));
+    } else {
+      first = last = parse_day(str, len);
+    }
+    if (first < 0 || last < 0) {
+      return 0;
+    }
+
+    // Ranges can wrap around the end of the week, i.e. fri-mon
+    for (int i = first; ; i = (i + 1) % 7) {
+      days |= 1 << i;
+      if (i == last) {
+        break;
+      }
+    }
+
+    str += len;
+    if (*str == ',') {
+      str++;
+    }
+  }
+
+  return days;
+}
+
+bool schedule_parse_rule(const char *str, schedule_rule_t *rule)
+{
+  char days[32];
+  unsigned int year, mon, mday, h1, m1, s1 = 0, h2, m2;
+  unsigned long interval;
+  int n = 0, n2 = 0;
+
+  memset(rule, 0, sizeof(*rule));
+
+  // Once rule: YYYY-MM-DD HH:MM[:SS]
+  if (sscanf(str, "%4u-%2u-%2u %2u:%2u%n",
+             &year, &mon, &mday, &h1, &m1, &n) == 5) {
+    if (sscanf(&str[n], ":%2u%n", &s1, &n2) == 1) {
+      n += n2;
+    }
+    if (str[n] != '\0' || year < 2000 || mon < 1 || mon > 12 ||
+        mday < 1 || mday > 31 || h1 > 23 || m1 > 59 || s1 > 59) {
+      return false;
+    }
+
+    rule->type = SCHEDULE_RULE_ONCE;
+    rule->date = year * 10000 + mon * 100 + mday;
+    rule->start = h1 * 3600 + m1 * 60 + s1;
+    return true;
+  }
+
+  // Window rule: DAYS HH:MM-HH:MM INTERVAL
+  if (sscanf(str, "%31s %2u:%2u-%2u:%2u %lu%n",
+             days, &h1, &m1, &h2, &m2, &interval, &n) != 6) {
+    return false;
+  }
+  if (h1 > 23 || m1 > 59 || h2 > 24 || m2 > 59 || (h2 == 24 && m2 != 0)) {
+    return false;
+  }
+
+  // Check against the maximum of 24 hours before scaling, so the
+  // multiplication can't overflow.
+  const char *unit = &str[n];
+  unsigned long scale;
+  if (strcmp(unit, "h") == 0) {
+    scale = 60 * 60 * 1000;
+  } else if (strcmp(unit, "m") == 0) {
+    scale = 60 * 1000;
+  } else if (strcmp(unit, "s") == 0) {
+    scale = 1000;
+  } else if (*unit == '\0' || strcmp(unit, "ms") == 0) {
+    scale = 1;
+  } else {
+    return false;
+  }
+  if (interval > 24 * 60 * 60 * 1000 / scale) {
+    return false;
+  }
+  interval *= scale;
+  // Date/Time filename format doesn't support intervals < 1 Second.
+  if (interval < 1000) {
+    return false;
+  }
+
+  rule->type = SCHEDULE_RULE_WINDOW;
+  rule->days = parse_days(days);
+  rule->start = h1 * 3600 + m1 * 60;
+  rule->end = (h2 * 3600 + m2 * 60) % (24 * 3600);
+  rule->interval = interval;
+
+  return rule->days != 0;
+}
+
+int schedule_format_rule(const schedule_rule_t *rule, char *buf, size_t size)
+{
+  size_t len = 0;
+
+  // Appends to buf, while counting the full length if buf is too small
+#define RULE_APPEND(...) \
+  len += snprintf(&buf[len < size ? len : size], len < size ? size - len : 0, \
+                  __VA_ARGS__)
+
+  if (rule->type == SCHEDULE_RULE_ONCE) {
+    RULE_APPEND("%04u-%02u-%02u %02u:%02u:%02u",
+                rule->date / 10000, rule->date / 100 % 100, rule->date % 100,
+                rule->start / 3600, rule->start / 60 % 60, rule->start % 60);
+    return len;
+  }
+
+  // Weekdays, consecutive days as range
+  if (rule->days == 0x7f) {
+    RULE_APPEND("*");
+  } else {
+    for (int i = 0; i < 7; i++) {
+      if ((rule->days & (1 << i)) == 0) {
+        continue;
+      }
+      int last = i;
+      while (last < 6 && (rule->days & (1 << (last + 1)))) {
+        last++;
+      }
+      RULE_APPEND("%s%s", (len > 0) ? "," : "", day_names[i]);
+      if (last > i) {
+        RULE_APPEND("-%s", day_names[last]);
+      }
+      i = last;
+    }
+  }
+
+  // A window ending at midnight is written as 24:00
+  RULE_APPEND(" %02u:%02u-%02u:%02u ",
+              rule->start / 3600, rule->start / 60 % 60,
+              (rule->end == 0) ? 24 : rule->end / 3600, rule->end / 60 % 60);
+
+  if (rule->interval % (60 * 60 * 1000) == 0) {
+    RULE_APPEND("%uh", rule->interval / (60 * 60 * 1000));
+  } else if (rule->interval % (60 * 1000) == 0) {
+    RULE_APPEND("%um", rule->interval / (60 * 1000));
+  } else if (rule->interval % 1000 == 0) {
+    RULE_APPEND("%us", rule->interval / 1000);
+  } else {
+    RULE_APPEND("%u", rule->interval);
+  }
+
+#undef RULE_APPEND
+
+  return len;
+}
+
+/**
+ * Convert local time to time_t
+ *
+ * @param day	Local time of any moment on the reference day
+ * @param days	Days to add to the reference day
+ * @param sec	Seconds since local midnight, can be more than a day
+ */
+static time_t local_time(const struct tm *day, int days, uint32_t sec)
+{
+  struct tm tm = *day;
+
+  // Normalize the date first, mktime() uses the DST flag of the denormalized
+  // time when normalizing.
+  tm.tm_mday += days + sec / DAY_SEC;
+  tm.tm_hour = 12;
+  tm.tm_min = 0;
+  tm.tm_sec = 0;
+  tm.tm_isdst = -1;
+  (void) mktime(&tm);
+
+  sec %= DAY_SEC;
+  tm.tm_hour = sec / 3600;
+  tm.tm_min = sec / 60 % 60;
+  tm.tm_sec = sec % 60;
+  tm.tm_isdst = -1;
+  return mktime(&tm);
+}
+
+/**
+ * Find first fire time of window rule after time from
+ *
+ * The window boundaries are computed with mktime(), so they follow daylight
+ * saving time transitions of the local time.
+ */
+static bool window_next(const schedule_rule_t *rule,
+                        const struct timeval *from, struct timeval *next)
+{
+  uint32_t duration = (rule->end + 24 * 3600 - rule->start) % (24 * 3600);
+  struct tm tm_from;
+
+  if (duration == 0) {
+    duration = 24 * 3600;
+  }
+
+  localtime_r(&from->tv_sec, &tm_from);
+
+  // Start at yesterday, its window can pass midnight
+  for (int d = -1; d <= 7; d++) {
+    if ((rule->days & (1 << ((tm_from.tm_wday + d + 7) % 7))) == 0) {
+      continue;
+    }
+
+    time_t start = local_time(&tm_from, d, rule->start);
+    time_t end = local_time(&tm_from, d, rule->start + duration);
+
+    if (from->tv_sec < start) {
+      next->tv_sec = start;
+      next->tv_usec = 0;
+      return true;
+    }
+
+    // Next point on the interval grid of this window
+    int64_t interval = (int64_t) rule->interval * 1000;
+    int64_t elapsed = (int64_t) (from->tv_sec - start) * 1000000 +
+                      from->tv_usec;
+    int64_t offset = (elapsed / interval + 1) * interval;
+    if (offset < (int64_t) (end - start) * 1000000) {
+      next->tv_sec = start + offset / 1000000;
+      next->tv_usec = offset % 1000000;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * Find fire time of once rule, if after time from
+ */
+static bool once_next(const schedule_rule_t *rule,
+                      const struct timeval *from, struct timeval *next)
+{
+  struct tm tm = {};
+
+  tm.tm_year = rule->date / 10000 - 1900;
+  tm.tm_mon = rule->date / 100 % 100 - 1;
+  tm.tm_mday = rule->date % 100;
+  tm.tm_sec = rule->start;
+  tm.tm_isdst = -1;
+  time_t t = mktime(&tm);
+
+  if (t <= from->tv_sec) {
+    return false;
+  }
+
+  next->tv_sec = t;
+  next->tv_usec = 0;
+  return true;
+}
+
+/**
+ * Find first fire time of all schedule rules after time from
+ *
+ * @returns	False if none of the rules fires after from
+ */
+static bool rules_next(const schedule_t *schedule,
+                       const struct timeval *from, struct timeval *next)
+{
+  bool found = false;
+
+  for (unsigned int i = 0; i < schedule->count; i++) {
+    const schedule_rule_t *rule = &schedule->rules[i];
+    struct timeval t;
+    bool fires;
+
+    if (rule->type == SCHEDULE_RULE_ONCE) {
+      fires = once_next(rule, from, &t);
+    } else {
+      fires = window_next(rule, from, &t);
+    }
+
+    if (fires && (!found || timercmp(&t, next, <))) {
+      *next = t;
+      found = true;
+    }
+  }
+
+  return found;
+}
+
+/**
+ * Set tv to the first fire time of the schedule rules at or after tv
+ *
+ * Fire times at night are skipped if night_mode is skip.
+ */
+static void rules_schedule(const schedule_t *schedule, struct timeval *tv)
+{
+  static const struct timeval one_usec = { 0, 1 };
+  struct timeval from;
+  time_t dawn;
+
+  timersub(tv, &one_usec, &from);
+  for (int i = 0; i < NIGHT_SKIP_MAX; i++) {
+    if (!rules_next(schedule, &from, tv)) {
+      // Check again tomorrow
+      Serial.println("No more scheduled captures");
+      tv->tv_sec = from.tv_sec + DAY_SEC;
+      tv->tv_usec = 0;
+      return;
+    }
+
+    if (cfg.getNightMode() != Configuration::NightModeSkip ||
+        !is_night(tv->tv_sec, &dawn)) {
+      return;
+    }
+
+    from.tv_sec = dawn;
+    from.tv_usec = 0;
+    timersub(&from, &one_usec, &from);
+  }
+}
+
+bool schedule_active(const struct timeval *tv)
+{
+  const schedule_t *schedule = cfg.getSchedule();
+  struct timeval t = *tv;
+
+  if (schedule->count == 0) {
+    return true;
+  }
+
+  rules_schedule(schedule, &t);
+  return timercmp(&t, tv, ==);
+}
+
+void schedule_next(struct timeval *tv)
+{
+  const schedule_t *schedule = cfg.getSchedule();
+  Configuration::NightMode night_mode = cfg.getNightMode();
+  unsigned int interval = cfg.getCaptureInterval();
+  struct timeval interval_tv;
+  time_t dawn;
+  bool night = false;
+
+  if (schedule->count != 0) {
+    static const struct timeval one_usec = { 0, 1 };
+    timeradd(tv, &one_usec, tv);
+    rules_schedule(schedule, tv);
+    return;
+  }
+
+  if (night_mode == Configuration::NightModeInterval) {
+    night = is_night(tv->tv_sec, &dawn);
+    if (night) {
+      interval = cfg.getNightInterval();
+    }
+  }
+
+  interval_tv.tv_sec = interval / 1000;
+  interval_tv.tv_usec = (interval % 1000) * 1000;
+  timeradd(tv, &interval_tv, tv);
+
+  // Continue with the day interval at dawn
+  if (night && tv->tv_sec > dawn) {
+    tv->tv_sec = dawn;
+    tv->tv_usec = 0;
+  }
+
+  schedule_adjust(tv);
+}
+
+void schedule_skip(struct timeval *tv, const struct timeval *now)
+{
+  const schedule_t *schedule = cfg.getSchedule();
+
+  if (schedule->count != 0) {
+    *tv = *now;
+    schedule_next(tv);
+    return;
+  }
+
+  // Skip whole intervals at once, the clock might have jumped far ahead
+  if (timercmp(tv, now, <)) {
+    uint64_t interval = (uint64_t) cfg.getCaptureInterval() * 1000;
+    struct timeval behind_tv;
+    timersub(now, tv, &behind_tv);
+    uint64_t behind = (uint64_t) behind_tv.tv_sec * 1000000 +
+                      behind_tv.tv_usec;
+    uint64_t skip = behind / interval * interval;
+    struct timeval skip_tv = {
+      (time_t) (skip / 1000000),
+      (suseconds_t) (skip % 1000000)
+    };
+    timeradd(tv, &skip_tv, tv);
+  }
+
+  // Remaining steps use the night handling of schedule_next()
+  while (!timercmp(now, tv, <)) {
+    schedule_next(tv);
+  }
+}
+
+void schedule_adjust(struct timeval *tv)
+{
+  const schedule_t *schedule = cfg.getSchedule();
+  time_t dawn;
+
+  if (schedule->count != 0) {
+    rules_schedule(schedule, tv);
+    return;
+  }
+
+  if (cfg.getNightMode() != Configuration::NightModeSkip) {
+    return;
+  }
+
+  if (is_night(tv->tv_sec, &dawn)) {
+    tv->tv_sec = dawn;
+    tv->tv_usec = 0;
+    Serial.printf("Night, next capture at dawn: %s", ctime(&dawn));
+  }
+}
@@ -0,0 +1,130 @@
+/**
+ * schedule.h - Capture scheduling
+ *
+ * Copyright (c) 2019, David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __SCHEDULE_H__
+#define __SCHEDULE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/time.h>
+
+// Maximum amount of schedule rules
+#define SCHEDULE_RULES_MAX 8
+
+// Schedule rule types
+#define SCHEDULE_RULE_WINDOW 0
+#define SCHEDULE_RULE_ONCE 1
+
+/**
+ * Capture schedule rule
+ *
+ * Window rules capture every interval milliseconds from start till end on the
+ * selected weekdays, aligned to the start of the window. Once rules capture a
+ * single image at a set date and time. All times are local time.
+ */
+typedef struct {
+  uint8_t type; /**< SCHEDULE_RULE_WINDOW or SCHEDULE_RULE_ONCE */
+  uint8_t days; /**< Window: bitmask of weekdays, bit 0 is Sunday */
+  uint32_t date; /**< Once: date as YYYYMMDD */
+  uint32_t start; /**< Seconds since midnight */
+  uint32_t end; /**< Window: seconds since midnight, <= start if the window
+                     passes midnight */
+  uint32_t interval; /**< Window: milliseconds between captures */
+} schedule_rule_t;
+
+/**
+ * Capture schedule
+ *
+ * If there are no rules, the capture interval is used.
+ */
+typedef struct {
+  uint8_t count; /**< Amount of rules */
+  schedule_rule_t rules[SCHEDULE_RULES_MAX];
+} schedule_t;
+
+/**
+ * Parse schedule rule
+ *
+ * Formats:
+ *  - DAYS HH:MM-HH:MM INTERVAL: Window rule. DAYS is '*', or a comma separated
+ *    list of weekdays (mon, tue, ...) and ranges of weekdays (mon-fri).
+ *    INTERVAL is in milliseconds, or has a s, m or h suffix.
+ *  - YYYY-MM-DD HH:MM[:SS]: Once rule.
+ *
+ * @returns	True on success, false if str is not a valid rule
+ */
+bool schedule_parse_rule(const char *str, schedule_rule_t *rule);
+
+/**
+ * Format schedule rule, in the format accepted by schedule_parse_rule()
+ *
+ * @returns	Length of the formatted rule, as snprintf()
+ */
+int schedule_format_rule(const schedule_rule_t *rule, char *buf, size_t size);
+
+/**
+ * Check if a capture is scheduled at time tv
+ *
+ * Only false if the schedule has rules, and tv is not the fire time of any of
+ * them. I.e. when waking up after the last once rule has passed.
+ */
+bool schedule_active(const struct timeval *tv);
+
+/**
+ * Advance to the next capture time
+ *
+ * If the schedule has rules, tv is set to the first time after tv at which
+ * any of the rules fires. Else the capture interval is added to tv. If
+ * night_mode is enabled and tv is at night, the night interval is used
+ * instead, or the capture is moved to dawn.
+ *
+ * @param tv	Time of the previous capture, updated to the next capture time
+ */
+void schedule_next(struct timeval *tv);
+
+/**
+ * Skip capture times that have already passed
+ *
+ * Advances tv to the first capture time after now, keeping the capture times
+ * aligned to the interval grid of tv.
+ *
+ * @param tv	Missed capture time, updated to the next capture time
+ * @param now	Current time
+ */
+void schedule_skip(struct timeval *tv, const struct timeval *now);
+
+/**
+ * Move capture time to the first time at or after tv a capture is allowed
+ *
+ * Moves tv to the first fire time of the schedule rules, if any, and to dawn
+ * if it is at night and night captures are skipped.
+ *
+ * @param tv	Capture time, updated if needed
+ */
+void schedule_adjust(struct timeval *tv);
+
+#endif // __SCHEDULE_H__
@@ -38,6 +38,9 @@
 
 #define ARRAY_SIZE(a) (sizeof(a)/sizeof((a)[0]))
 
+// Size of buffer for configuration JSON object
+#define CONFIG_JSON_MAX 2048
+
 static const byte DNS_PORT = 53;
 static const IPAddress SERVER_IP(192, 168, 1, 1);
 static const IPAddress GATEWAY_IP(0, 0, 0, 0);
@@ -59,7 +62,7 @@ void httpHandleImage()
 {
   camera_fb_t *fb;
 
-  fb = camera_capture();
+  fb = camera_capture(true);
 
   // FIXME: *_P() functions require buf to be DWORD aligned!! It probably is. (is this also required for the DMA engine that writes to buf?)
   webServer.send_P(200, "image/jpeg", (const char *) fb->buf, fb->len);
@@ -69,7 +72,9 @@ void httpHandleImage()
 
 void httpHandleApply()
 {
-  if (cfg.saveConfig()) {
+  bool minimal = (webServer.arg("minimal") == "1");
+
+  if (cfg.saveConfig(minimal)) {
     webServer.send(200, "application/json", "{\"success\":true}");
   } else {
     webServer.send(200, "application/json", "{\"success\":false, \"error\":\"Failed to save config\"}");
@@ -132,7 +137,16 @@ void httpHandleSetTime()
 
 void httpHandleConfig()
 {
-  webServer.send(200, "application/json", cfg.configAsJSON());
+  static char json[CONFIG_JSON_MAX];
+
+  size_t len = cfg.configAsJSON(json, sizeof(json));
+  if (len >= sizeof(json)) {
+    webServer.send(500, "application/json",
+        "{\"success\":false,\"error\":\"Configuration too large\"}");
+    return;
+  }
+
+  webServer.send_P(200, "application/json", json, len);
 }
 
 void httpHandleRoot()
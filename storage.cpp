@@ -0,0 +1,982 @@
+/**
+ * storage.cpp - SD card and capture directory handling
+ *
+ * Copyright (c) 2019, David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+
+#include "Arduino.h"
+
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <ctype.h>
+
+#include "driver/sdmmc_host.h"
+#include "driver/sdmmc_defs.h"
+#include "sdmmc_cmd.h"
+#include "esp_vfs_fat.h"
+#include "ff.h"
+
+#include "avi.h"
+#include "configuration.h"
+#include "storage.h"
+
+// Timelapse directory name format: <mount point>/timelapseXXXX/
+// The index is at least 4 digits, but may grow beyond that.
+#define CAPTURE_DIR_PREFIX "timelapse"
+#define CAPTURE_DIR_PREFIX_LEN 9
+#define CAPTURE_DIR_IDX_MIN_LEN 4
+#define CAPTURE_DIR_IDX_MAX_LEN 10
+
+// File storing the index of the last created capture directory. Used to
+// avoid scanning the root directory on cold boot.
+#define CAPTURE_DIR_INDEX_FILE SDCARD_MOUNT_POINT "/timelapse.idx"
+
+// Maximum length of shard subdirectory path, eg. "/20191016/13"
+#define STORAGE_SHARD_MAX 16
+
+// Maximum length of image file path
+#define STORAGE_PATH_MAX (sizeof(capture_path) + STORAGE_SHARD_MAX + 15 + 4 + 4 + 1)
+
+// Sector size of SD card
+#define STORAGE_SECTOR_SIZE 512
+
+// Maximum size of header staging buffer, must be a multiple of the sector
+// size. Larger headers are written unaligned.
+#define STORAGE_STAGE_MAX (4 * STORAGE_SECTOR_SIZE)
+
+// FatFs logical drive of the SD card. esp_vfs_fat_sdmmc_mount() registers the
+// card as the first FatFs drive.
+#define STORAGE_FATFS_DRIVE "0:"
+
+// Magic value to detect valid capture directory state in RTC memory
+#define STORAGE_STATE_MAGIC 0x53544f52
+
+// Magic value to detect valid free space state in RTC memory
+#define STORAGE_SPACE_MAGIC 0x53504143
+
+// Refresh the free space estimate from the file system every this many images
+#define STORAGE_SPACE_REFRESH 100
+
+// Maximum amount of files to delete per image when reclaiming space
+#define STORAGE_RECLAIM_FILES 8
+
+// Maximum amount of directories to scan per image when reclaiming space
+#define STORAGE_RECLAIM_SCANS 4
+
+// Maximum length of file and directory names created by the camera
+#define STORAGE_NAME_MAX 24
+
+static char capture_path[sizeof(SDCARD_MOUNT_POINT) + CAPTURE_DIR_PREFIX_LEN +
+                         CAPTURE_DIR_IDX_MAX_LEN + 1];
+
+/**
+ * Capture directory state in RTC memory
+ *
+ * Allows to continue in the same directory after waking from deep sleep
+ * without touching the SD card.
+ */
+RTC_DATA_ATTR static struct {
+  uint32_t magic;
+  uint32_t dir_idx; /**< Index of current capture directory */
+  char shard[STORAGE_SHARD_MAX]; /**< Current shard subdirectory, or "" */
+  uint32_t shard_idx; /**< Index of current shard in count mode */
+  uint32_t shard_files; /**< Files in current shard in count mode */
+} storage_state;
+
+/**
+ * Free space state in RTC memory
+ *
+ * Getting the free space from FatFs can require a scan of the whole FAT.
+ * Instead the free space is counted down for every image, and only refreshed
+ * from the file system every STORAGE_SPACE_REFRESH images.
+ */
+RTC_DATA_ATTR static struct {
+  uint32_t magic;
+  uint64_t free_bytes; /**< Estimated free space */
+  uint32_t cluster_size; /**< Bytes per cluster */
+  uint32_t writes; /**< Images since last refresh */
+  uint32_t oldest_dir_idx; /**< Oldest capture directory index, 0 if unknown */
+  uint32_t skipped_dir_idx; /**< Capture directory of skipped_shard */
+  char skipped_shard[STORAGE_SHARD_MAX]; /**< Newest shard that couldn't be
+                                              deleted, empty if none */
+} storage_space;
+
+/**
+ * Get cluster size of FatFs file system in bytes
+ */
+static size_t fs_cluster_size(const FATFS *fs)
+{
+#if FF_MAX_SS != FF_MIN_SS
+  return fs->csize * fs->ssize;
+#else
+  return fs->csize * FF_MAX_SS;
+#endif
+}
+
+bool storage_init()
+{
+  esp_err_t ret = ESP_FAIL;
+  sdmmc_host_t host = SDMMC_HOST_DEFAULT();
+  sdmmc_slot_config_t slot_config = SDMMC_SLOT_CONFIG_DEFAULT();
+  esp_vfs_fat_sdmmc_mount_config_t mount_config = {
+    .format_if_mount_failed = false,
+    .max_files = 1,
+  };
+  sdmmc_card_t *card;
+
+#ifdef WITH_SD_4BIT
+  host.flags = SDMMC_HOST_FLAG_4BIT;
+  slot_config.width = 4;
+#else
+  host.flags = SDMMC_HOST_FLAG_1BIT;
+  slot_config.width = 1;
+#endif
+
+  Serial.print("Mounting SD card... ");
+  ret = esp_vfs_fat_sdmmc_mount(SDCARD_MOUNT_POINT, &host, &slot_config,
+                                &mount_config, &card);
+  if (ret == ESP_OK) {
+    Serial.println("Done");
+  }  else  {
+    Serial.println("FAILED");
+    Serial.printf("Failed to mount SD card VFAT filesystem. Error: %s\n",
+                     esp_err_to_name(ret));
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Find highest capture directory index by scanning the root directory
+ *
+ * @param[out] dir_idx		Highest index found, or 0 if no capture
+ *				directories
+ * @param[in,out] first_idx	Lowest index found that is at least the
+ *				passed value, or 0 if none. May be NULL.
+ *
+ * @returns	True on success, else false
+ */
+static bool scan_capture_dirs(uint32_t *dir_idx, uint32_t *first_idx)
+{
+  DIR *dirp;
+  struct dirent *dp;
+
+  uint32_t min_idx = 0;
+
+  *dir_idx = 0;
+  if (first_idx != NULL) {
+    min_idx = *first_idx;
+    *first_idx = 0;
+  }
+
+  if ((dirp = opendir(SDCARD_MOUNT_POINT "/")) == NULL) {
+    Serial.println("couldn't open directory " SDCARD_MOUNT_POINT "/");
+    return false;
+  }
+
+  do {
+    errno = 0;
+    if ((dp = readdir(dirp)) != NULL) {
+      size_t len = strlen(dp->d_name);
+      if (len < CAPTURE_DIR_PREFIX_LEN + CAPTURE_DIR_IDX_MIN_LEN ||
+          len > CAPTURE_DIR_PREFIX_LEN + CAPTURE_DIR_IDX_MAX_LEN)
+        continue;
+      if (strncasecmp(dp->d_name, CAPTURE_DIR_PREFIX,
+          CAPTURE_DIR_PREFIX_LEN) != 0)
+        continue;
+
+      const char *idx_str = &(dp->d_name[CAPTURE_DIR_PREFIX_LEN]);
+      if (!isdigit((unsigned char) *idx_str))
+        continue;
+
+      char *endp;
+      unsigned long idx = strtoul(idx_str, &endp, 10);
+      if (*endp != '\0' || idx > UINT32_MAX)
+        continue;
+
+      if (idx > *dir_idx) {
+        *dir_idx = idx;
+      }
+      if (first_idx != NULL && idx >= min_idx &&
+          (*first_idx == 0 || idx < *first_idx)) {
+        *first_idx = idx;
+      }
+    }
+  } while (dp != NULL);
+
+  (void) closedir(dirp);
+
+  if (errno != 0) {
+    Serial.println("Error reading directory " SDCARD_MOUNT_POINT "/");
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Read last capture directory index from index file
+ *
+ * @returns	True on success, false if file doesn't exist or is invalid
+ */
+static bool read_index_file(uint32_t *dir_idx)
+{
+  FILE *fp = fopen(CAPTURE_DIR_INDEX_FILE, "r");
+  if (fp == NULL) {
+    return false;
+  }
+
+  unsigned long idx;
+  bool ok = (fscanf(fp, "%lu", &idx) == 1 && idx <= UINT32_MAX);
+  fclose(fp);
+
+  if (ok) {
+    *dir_idx = idx;
+  }
+
+  return ok;
+}
+
+/**
+ * Write last capture directory index to index file
+ */
+static bool write_index_file(uint32_t dir_idx)
+{
+  FILE *fp = fopen(CAPTURE_DIR_INDEX_FILE, "w");
+  if (fp == NULL) {
+    return false;
+  }
+
+  bool ok = (fprintf(fp, "%lu\n", (unsigned long) dir_idx) > 0);
+  if (fclose(fp) != 0) {
+    ok = false;
+  }
+
+  return ok;
+}
+
+static void set_capture_path(uint32_t dir_idx)
+{
+  snprintf(capture_path, sizeof(capture_path),
+	SDCARD_MOUNT_POINT "/" CAPTURE_DIR_PREFIX "%04lu",
+	(unsigned long) dir_idx);
+}
+
+bool storage_init_capture_dir(bool reuse_last_dir)
+{
+  uint32_t dir_idx = 0;
+
+  // After deep sleep the directory is known from RTC memory
+  if (reuse_last_dir && storage_state.magic == STORAGE_STATE_MAGIC) {
+    set_capture_path(storage_state.dir_idx);
+    Serial.print("Storing pictures in: ");
+    Serial.println(capture_path);
+    return true;
+  }
+
+  storage_state.magic = 0;
+  storage_state.shard[0] = '\0';
+  storage_state.shard_idx = 0;
+  storage_state.shard_files = 0;
+
+  // The card might have been changed
+  storage_space.magic = 0;
+
+  // Else read the last index from the index file. Fall back to
+  // scanning the root directory for cards without index file.
+  bool from_index_file = read_index_file(&dir_idx);
+  if (!from_index_file) {
+    if (!scan_capture_dirs(&dir_idx, NULL)) {
+      return false;
+    }
+  }
+
+  if (!reuse_last_dir) {
+    if (dir_idx == UINT32_MAX) {
+      Serial.println("Out of capture directory indexes");
+      return false;
+    }
+    dir_idx += 1;
+
+    // Create new dir
+    set_capture_path(dir_idx);
+    int ret = mkdir(capture_path, 0755);
+    if (ret != 0 && errno == EEXIST && from_index_file) {
+      // Index file is out of date, e.g. card was modified on a PC
+      Serial.println("Capture directory index file is stale, rescanning");
+      if (!scan_capture_dirs(&dir_idx, NULL) || dir_idx == UINT32_MAX) {
+        return false;
+      }
+      dir_idx += 1;
+      set_capture_path(dir_idx);
+      ret = mkdir(capture_path, 0755);
+    }
+    if (ret != 0) {
+      Serial.print("Failed to create directory: ");
+      Serial.println(capture_path);
+      return false;
+    }
+
+    if (!write_index_file(dir_idx)) {
+      Serial.println("Failed to write capture directory index file");
+    }
+  } else {
+    set_capture_path(dir_idx);
+  }
+
+  storage_state.dir_idx = dir_idx;
+  storage_state.magic = STORAGE_STATE_MAGIC;
+
+  Serial.print("Storing pictures in: ");
+  Serial.println(capture_path);
+
+  return true;
+}
+
+const char *storage_get_capture_path()
+{
+  return capture_path;
+}
+
+/**
+ * Select shard subdirectory for image, and create it if needed
+ *
+ * The current shard is kept in RTC memory, so the subdirectory is only
+ * created once when starting a new shard.
+ *
+ * @param timeinfo	Capture time of image
+ *
+ * @returns	True on success, else false
+ */
+static bool select_shard(const struct tm *timeinfo)
+{
+  char shard[STORAGE_SHARD_MAX];
+
+  switch (cfg.getShardMode()) {
+  case Configuration::ShardModeDay:
+    strftime(shard, sizeof(shard), "/%Y%m%d", timeinfo);
+    break;
+  case Configuration::ShardModeHour:
+    strftime(shard, sizeof(shard), "/%Y%m%d/%H", timeinfo);
+    break;
+  case Configuration::ShardModeCount:
+    if (storage_state.shard_files >= cfg.getShardSize()) {
+      storage_state.shard_idx++;
+      storage_state.shard_files = 0;
+    }
+    snprintf(shard, sizeof(shard), "/%05lu",
+             (unsigned long) storage_state.shard_idx);
+    break;
+  default:
+    shard[0] = '\0';
+    break;
+  }
+
+  if (strcmp(shard, storage_state.shard) == 0) {
+    return true;
+  }
+
+  // Create every level of the shard path
+  char path[sizeof(capture_path) + STORAGE_SHARD_MAX];
+  size_t capture_path_len = strlen(capture_path);
+  strcpy(path, capture_path);
+  for (size_t i = 1; shard[i - 1] != '\0'; i++) {
+    if (shard[i] != '/' && shard[i] != '\0') {
+      continue;
+    }
+
+    memcpy(&path[capture_path_len], shard, i);
+    path[capture_path_len + i] = '\0';
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+      Serial.print("Failed to create directory: ");
+      Serial.println(path);
+      return false;
+    }
+  }
+
+  strcpy(storage_state.shard, shard);
+
+  return true;
+}
+
+/**
+ * Write file using stdio
+ */
+static bool write_file_stdio(const char *filename,
+                             const uint8_t *hdr, size_t hdr_len,
+                             const uint8_t *data, size_t data_len)
+{
+  FILE *file = fopen(filename, "w");
+  if (file == NULL)  {
+    Serial.printf("Failed\nCould not open file: %s", filename);
+    Serial.println();
+    return false;
+  }
+
+  unsigned int buf_size = cfg.getWriteBufferSize();
+  if (buf_size > 0) {
+    if (setvbuf(file, NULL, _IOFBF, buf_size) != 0) {
+      Serial.println("Failed to set write buffer size");
+    }
+  }
+
+  bool retval = true;
+  if (hdr != NULL && hdr_len > 0) {
+    if (fwrite(hdr, hdr_len, 1, file) != 1) {
+      Serial.println("Failed\nError while writing header to file");
+      retval = false;
+    }
+  }
+
+  if (retval && fwrite(data, data_len, 1, file) != 1) {
+    Serial.println("Failed\nError while writing to file");
+    retval = false;
+  }
+
+  if (fclose(file) != 0) {
+    retval = false;
+  }
+
+  return retval;
+}
+
+/**
+ * Write buffer to FatFs file in cluster aligned chunks
+ *
+ * Every chunk ends on a cluster boundary, so every f_write() call maps to a
+ * single contiguous range of sectors.
+ */
+static bool write_chunks(FIL *fp, const uint8_t *buf, size_t len,
+                         size_t cluster_size)
+{
+  while (len > 0) {
+    size_t chunk = cluster_size - (f_tell(fp) % cluster_size);
+    if (chunk > len) {
+      chunk = len;
+    }
+
+    UINT written;
+    if (f_write(fp, buf, chunk, &written) != FR_OK || written != chunk) {
+      return false;
+    }
+
+    buf += chunk;
+    len -= chunk;
+  }
+
+  return true;
+}
+
+/**
+ * Write file using FatFs, pre-allocating the file's clusters
+ *
+ * The file is first expanded to its final size, so the cluster chain is
+ * allocated in one go instead of growing it cluster by cluster while
+ * writing. This bypasses the VFS layer, which doesn't expose a way to
+ * pre-allocate or truncate files.
+ */
+static bool write_file_prealloc(const char *filename,
+                                const uint8_t *hdr, size_t hdr_len,
+                                const uint8_t *data, size_t data_len)
+{
+  // Static because FIL contains a sector buffer. Files are only written from
+  // one task at a time.
+  static FIL fp;
+  char ff_path[sizeof(STORAGE_FATFS_DRIVE) + STORAGE_PATH_MAX];
+  bool retval = false;
+
+  snprintf(ff_path, sizeof(ff_path), STORAGE_FATFS_DRIVE "%s",
+           &filename[sizeof(SDCARD_MOUNT_POINT) - 1]);
+
+  if (f_open(&fp, ff_path, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) {
+    Serial.printf("Failed\nCould not open file: %s", filename);
+    Serial.println();
+    return false;
+  }
+
+  size_t cluster_size = fs_cluster_size(fp.obj.fs);
+
+  // Expand file to final size. Seeking beyond the end of a file opened for
+  // writing allocates the clusters. If the disk is full the file pointer
+  // stops at the end of the allocated space.
+  size_t total_len = hdr_len + data_len;
+  if (f_lseek(&fp, total_len) != FR_OK || f_tell(&fp) != total_len) {
+    Serial.println("Failed\nCould not pre-allocate file");
+    goto fail;
+  }
+  if (f_lseek(&fp, 0) != FR_OK) {
+    goto fail;
+  }
+
+  if (hdr != NULL && hdr_len > 0) {
+    if (!write_chunks(&fp, hdr, hdr_len, cluster_size)) {
+      Serial.println("Failed\nError while writing header to file");
+      goto fail;
+    }
+  }
+
+  if (!write_chunks(&fp, data, data_len, cluster_size)) {
+    Serial.println("Failed\nError while writing to file");
+    goto fail;
+  }
+
+  retval = true;
+
+fail:
+  // Drop any pre-allocated space that wasn't written
+  (void) f_truncate(&fp);
+  if (f_close(&fp) != FR_OK) {
+    retval = false;
+  }
+
+  return retval;
+}
+
+bool storage_set_file_size(const char *filename, uint32_t size)
+{
+  // Static because FIL contains a sector buffer. Files are only written from
+  // one task at a time.
+  static FIL fp;
+  char ff_path[sizeof(STORAGE_FATFS_DRIVE) + STORAGE_PATH_MAX];
+  bool retval = false;
+
+  snprintf(ff_path, sizeof(ff_path), STORAGE_FATFS_DRIVE "%s",
+           &filename[sizeof(SDCARD_MOUNT_POINT) - 1]);
+
+  if (f_open(&fp, ff_path, FA_WRITE | FA_OPEN_EXISTING) != FR_OK) {
+    Serial.printf("Could not open file: %s\n", filename);
+    return false;
+  }
+
+  // Seeking beyond the end allocates the clusters, truncating at the new file
+  // pointer drops them again if the file shrinks.
+  if (f_lseek(&fp, size) == FR_OK && f_tell(&fp) == size &&
+      f_truncate(&fp) == FR_OK) {
+    retval = true;
+  } else {
+    Serial.printf("Could not resize file %s to %u bytes\n",
+                  filename, (unsigned int) size);
+  }
+
+  if (f_close(&fp) != FR_OK) {
+    retval = false;
+  }
+
+  return retval;
+}
+
+bool storage_write_jpeg(const struct timeval *tv,
+                        const uint8_t *hdr, size_t hdr_len,
+                        const uint8_t *data, size_t data_len)
+{
+  // Generate filename
+  struct tm timeinfo;
+  localtime_r(&tv->tv_sec, &timeinfo);
+
+  if (!select_shard(&timeinfo)) {
+    return false;
+  }
+
+  char filename[STORAGE_PATH_MAX];
+  size_t path_len = snprintf(filename, sizeof(filename), "%s%s",
+                             capture_path, storage_state.shard);
+  path_len += strftime(&filename[path_len], sizeof(filename) - path_len,
+                       "/%Y%m%d_%H%M%S", &timeinfo);
+
+  // Multiple images per second in burst mode, add milliseconds
+  if (cfg.getBurstCount() > 1 &&
+      cfg.getBurstSelect() == Configuration::BurstSelectAll) {
+    snprintf(&filename[path_len], sizeof(filename) - path_len,
+             "_%03lu.jpg", (unsigned long) tv->tv_usec / 1000);
+  } else {
+    snprintf(&filename[path_len], sizeof(filename) - path_len, ".jpg");
+  }
+
+  // Merge the header with the start of the JPEG data into one block that
+  // ends on a sector boundary. The data then starts sector aligned in the
+  // file, so both writes can be done without read-modify-write of sectors.
+  static uint8_t stage_buf[STORAGE_STAGE_MAX];
+  if (hdr != NULL && hdr_len > 0) {
+    size_t stage_len = (hdr_len + STORAGE_SECTOR_SIZE - 1) &
+                       ~(STORAGE_SECTOR_SIZE - 1);
+    if (stage_len - hdr_len > data_len) {
+      stage_len = hdr_len + data_len;
+    }
+    if (stage_len <= sizeof(stage_buf)) {
+      size_t head_len = stage_len - hdr_len;
+      memcpy(stage_buf, hdr, hdr_len);
+      memcpy(&stage_buf[hdr_len], data, head_len);
+      hdr = stage_buf;
+      hdr_len = stage_len;
+      data += head_len;
+      data_len -= head_len;
+    }
+  }
+
+  // Save picture
+  unsigned long start = micros();
+  bool retval;
+  if (cfg.getPrealloc()) {
+    retval = write_file_prealloc(filename, hdr, hdr_len, data, data_len);
+  } else {
+    retval = write_file_stdio(filename, hdr, hdr_len, data, data_len);
+  }
+  unsigned long write_usec = micros() - start;
+
+  if (retval) {
+    storage_state.shard_files++;
+    Serial.printf("Saved as %s (%zu bytes in %lu us)", filename,
+                  hdr_len + data_len, write_usec);
+    Serial.println();
+  }
+
+  return retval;
+}
+
+/**
+ * Refresh free space estimate from the file system
+ *
+ * @returns	True on success, else false
+ */
+static bool refresh_free_space()
+{
+  FATFS *fs;
+  DWORD free_clusters;
+
+  if (f_getfree(STORAGE_FATFS_DRIVE, &free_clusters, &fs) != FR_OK) {
+    Serial.println("Failed to get free space of SD card");
+    return false;
+  }
+
+  if (storage_space.magic != STORAGE_SPACE_MAGIC) {
+    storage_space.oldest_dir_idx = 0;
+    storage_space.skipped_shard[0] = '\0';
+  }
+  storage_space.cluster_size = fs_cluster_size(fs);
+  storage_space.free_bytes = (uint64_t) free_clusters *
+                             storage_space.cluster_size;
+  storage_space.writes = 0;
+  storage_space.magic = STORAGE_SPACE_MAGIC;
+
+  Serial.printf("SD card free space: %llu MB\n",
+                (unsigned long long) (storage_space.free_bytes >> 20));
+
+  return true;
+}
+
+/**
+ * Check if directory entry was created by the camera
+ *
+ * Only these entries are ever deleted. Shard subdirectories have numeric
+ * names, images and videos have a .jpg or .avi extension.
+ */
+static bool is_capture_entry(const char *name, bool is_dir)
+{
+  size_t len = strlen(name);
+
+  if (len == 0 || len >= STORAGE_NAME_MAX) {
+    return false;
+  }
+
+  if (is_dir) {
+    return strspn(name, "0123456789") == len;
+  }
+
+  return len > 4 && (strcasecmp(&name[len - 4], ".jpg") == 0 ||
+                     strcasecmp(&name[len - 4], ".avi") == 0);
+}
+
+/**
+ * Check if shard directory was skipped by an earlier reclaim
+ *
+ * Shards that can't be deleted because they contain entries not created by
+ * the camera are remembered in RTC memory. All shards up to and including the
+ * last one skipped are older, and are ignored from then on.
+ *
+ * @param shard	Path of shard relative to the capture directory, eg.
+ *		"/20191016/13"
+ */
+static bool is_skipped_shard(const char *shard)
+{
+  const char *skipped = storage_space.skipped_shard;
+  size_t len = strlen(shard);
+
+  if (skipped[0] == '\0') {
+    return false;
+  }
+  // Parent of the skipped shard, may still contain newer shards
+  if (strncmp(skipped, shard, len) == 0 && skipped[len] == '/') {
+    return false;
+  }
+
+  return strcmp(shard, skipped) <= 0;
+}
+
+/**
+ * Find oldest entries of capture directory
+ *
+ * All names created by the camera sort chronologically, so the oldest entries
+ * are the entries with the lowest names. The directory order can't be used,
+ * since FAT reuses the slots of deleted entries.
+ *
+ * @param path		Directory to scan
+ * @param shard		Part of path relative to the capture directory
+ * @param[out] names	Names of oldest entries, sorted oldest first
+ * @param[out] is_dir	True if the entry is a directory
+ * @param[out] count	Amount of entries found
+ *
+ * @returns	True on success, else false
+ */
+static bool find_oldest_entries(const char *path, const char *shard,
+                                char names[][STORAGE_NAME_MAX],
+                                bool *is_dir, unsigned int *count)
+{
+  DIR *dirp;
+  struct dirent *dp;
+  char sub_shard[STORAGE_SHARD_MAX + STORAGE_NAME_MAX];
+
+  *count = 0;
+
+  if ((dirp = opendir(path)) == NULL) {
+    return false;
+  }
+
+  // Insertion sort, only keeping the STORAGE_RECLAIM_FILES lowest names
+  while ((dp = readdir(dirp)) != NULL) {
+    bool dir = (dp->d_type == DT_DIR);
+    if (!is_capture_entry(dp->d_name, dir)) {
+      continue;
+    }
+    if (dir) {
+      // Don't match a truncated path against the skipped shard
+      if (snprintf(sub_shard, sizeof(sub_shard), "%s/%s", shard,
+                   dp->d_name) >= (int) sizeof(sub_shard) ||
+          is_skipped_shard(sub_shard)) {
+        continue;
+      }
+    }
+
+    unsigned int i = *count;
+    while (i > 0 && strcmp(names[i - 1], dp->d_name) > 0) {
+      if (i < STORAGE_RECLAIM_FILES) {
+        strcpy(names[i], names[i - 1]);
+        is_dir[i] = is_dir[i - 1];
+      }
+      i--;
+    }
+    if (i < STORAGE_RECLAIM_FILES) {
+      strcpy(names[i], dp->d_name);
+      is_dir[i] = dir;
+      if (*count < STORAGE_RECLAIM_FILES) {
+        (*count)++;
+      }
+    }
+  }
+
+  (void) closedir(dirp);
+
+  return true;
+}
+
+/**
+ * Get path of oldest capture directory
+ *
+ * The oldest directory index is kept in RTC memory. The root directory is
+ * only scanned if it is unknown, or the directory doesn't exist anymore.
+ *
+ * @returns	True on success, false if there are no capture directories
+ */
+static bool oldest_capture_dir(char *path, size_t size)
+{
+  struct stat st;
+
+  if (storage_space.oldest_dir_idx != 0) {
+    snprintf(path, size, SDCARD_MOUNT_POINT "/" CAPTURE_DIR_PREFIX "%04lu",
+             (unsigned long) storage_space.oldest_dir_idx);
+    if (stat(path, &st) == 0) {
+      return true;
+    }
+  }
+
+  // Lowest existing index from the last known oldest index
+  uint32_t last_idx;
+  if (!scan_capture_dirs(&last_idx, &storage_space.oldest_dir_idx) ||
+      storage_space.oldest_dir_idx == 0) {
+    return false;
+  }
+
+  snprintf(path, size, SDCARD_MOUNT_POINT "/" CAPTURE_DIR_PREFIX "%04lu",
+           (unsigned long) storage_space.oldest_dir_idx);
+  return true;
+}
+
+/**
+ * Delete oldest images until the free space is at least min_free
+ *
+ * The amount of files deleted and directories scanned is bounded, so the time
+ * spent per image is limited. The remaining space is reclaimed on the next
+ * images.
+ *
+ * @returns	Amount of deleted files
+ */
+static unsigned int reclaim_space(uint64_t min_free)
+{
+  char names[STORAGE_RECLAIM_FILES][STORAGE_NAME_MAX];
+  bool is_dir[STORAGE_RECLAIM_FILES];
+  char shard_path[sizeof(capture_path) + STORAGE_SHARD_MAX];
+  char path[STORAGE_PATH_MAX];
+  unsigned int deleted = 0;
+  unsigned int scans = 0;
+
+  snprintf(shard_path, sizeof(shard_path), "%s%s", capture_path,
+           storage_state.shard);
+
+  while (storage_space.free_bytes < min_free &&
+         deleted < STORAGE_RECLAIM_FILES && scans < STORAGE_RECLAIM_SCANS) {
+    if (!oldest_capture_dir(path, sizeof(path))) {
+      Serial.println("No capture directories to delete images from");
+      return deleted;
+    }
+    if (storage_space.skipped_dir_idx != storage_space.oldest_dir_idx) {
+      storage_space.skipped_shard[0] = '\0';
+    }
+
+    // Descend into the oldest shard subdirectory
+    unsigned int count;
+    size_t path_len = strlen(path);
+    size_t top_len = path_len;
+    bool is_top = true;
+    while (true) {
+      if (scans++ >= STORAGE_RECLAIM_SCANS) {
+        return deleted;
+      }
+      if (!find_oldest_entries(path, &path[top_len], names, is_dir, &count)) {
+        Serial.printf("Failed to read directory: %s\n", path);
+        return deleted;
+      }
+      if (count == 0 || !is_dir[0] ||
+          path_len + 1 + strlen(names[0]) >= sizeof(path) - STORAGE_NAME_MAX) {
+        break;
+      }
+      path_len += snprintf(&path[path_len], sizeof(path) - path_len, "/%s",
+                           names[0]);
+      is_top = false;
+    }
+
+    // Remove empty directory, unless still in use
+    if (count == 0) {
+      if (strcmp(path, capture_path) == 0 || strcmp(path, shard_path) == 0) {
+        Serial.println("Only the current images left, not deleting them");
+        return deleted;
+      }
+      // Fails if the directory contains entries not created by the camera
+      int ret = rmdir(path);
+      if (ret == 0) {
+        Serial.printf("Deleted directory: %s\n", path);
+      }
+      if (is_top) {
+        if (ret != 0) {
+          Serial.printf("Skipping directory: %s\n", path);
+        }
+        storage_space.oldest_dir_idx++;
+      } else if (ret != 0) {
+        // Remember the shard, else every reclaim gets stuck on it
+        if (path_len - top_len >= sizeof(storage_space.skipped_shard)) {
+          Serial.printf("Failed to delete directory: %s\n", path);
+          return deleted;
+        }
+        Serial.printf("Skipping directory: %s\n", path);
+        strcpy(storage_space.skipped_shard, &path[top_len]);
+        storage_space.skipped_dir_idx = storage_space.oldest_dir_idx;
+      }
+      continue;
+    }
+
+    // Delete oldest files
+    for (unsigned int i = 0; i < count &&
+         deleted < STORAGE_RECLAIM_FILES &&
+         storage_space.free_bytes < min_free; i++) {
+      struct stat st;
+
+      if (is_dir[i]) {
+        break;
+      }
+      snprintf(&path[path_len], sizeof(path) - path_len, "/%s", names[i]);
+      if (strcmp(path, avi_get_path()) == 0) {
+        continue;
+      }
+      if (stat(path, &st) != 0 || unlink(path) != 0) {
+        Serial.printf("Failed to delete: %s\n", path);
+        return deleted;
+      }
+      deleted++;
+
+      uint32_t cluster_size = storage_space.cluster_size;
+      storage_space.free_bytes += ((uint64_t) st.st_size + cluster_size - 1) /
+                                  cluster_size * cluster_size;
+    }
+    path[path_len] = '\0';
+  }
+
+  return deleted;
+}
+
+void storage_reserve(size_t len)
+{
+  uint64_t min_free = (uint64_t) cfg.getMinFreeSpace() << 20;
+
+  if (min_free == 0) {
+    return;
+  }
+
+  if (storage_space.magic != STORAGE_SPACE_MAGIC ||
+      storage_space.writes >= STORAGE_SPACE_REFRESH) {
+    if (!refresh_free_space()) {
+      return;
+    }
+  }
+
+  uint32_t cluster_size = storage_space.cluster_size;
+  uint64_t used = ((uint64_t) len + cluster_size - 1) / cluster_size *
+                  cluster_size;
+  if (storage_space.free_bytes > used) {
+    storage_space.free_bytes -= used;
+  } else {
+    storage_space.free_bytes = 0;
+  }
+  storage_space.writes++;
+
+  if (storage_space.free_bytes < min_free) {
+    unsigned int deleted = reclaim_space(min_free + used);
+    Serial.printf("Deleted %u old images, free space: %llu MB\n", deleted,
+                  (unsigned long long) (storage_space.free_bytes >> 20));
+  }
+}
@@ -0,0 +1,102 @@
+/**
+ * storage.h - SD card and capture directory handling
+ *
+ * Copyright (c) 2019, David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __STORAGE_H__
+#define __STORAGE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/time.h>
+
+/**
+ * Mount SD card at SDCARD_MOUNT_POINT
+ *
+ * @returns	True on success, else false
+ */
+bool storage_init();
+
+/**
+ * Select directory to store images in
+ *
+ * @param reuse_last_dir	Continue in the last used directory, instead of
+ *				creating a new one
+ *
+ * @returns	True on success, else false
+ */
+bool storage_init_capture_dir(bool reuse_last_dir);
+
+/**
+ * Get path of current capture directory
+ */
+const char *storage_get_capture_path();
+
+/**
+ * Write image to file in capture directory
+ *
+ * The file name is derived from the capture time. The file content is the
+ * concatenation of hdr and data.
+ *
+ * @param tv		Capture time
+ * @param hdr		JPEG/Exif header, or NULL
+ * @param hdr_len	Length of hdr
+ * @param data		JPEG data following the header
+ * @param data_len	Length of data
+ *
+ * @returns	True on success, else false
+ */
+bool storage_write_jpeg(const struct timeval *tv,
+                        const uint8_t *hdr, size_t hdr_len,
+                        const uint8_t *data, size_t data_len);
+
+/**
+ * Set size of an existing file
+ *
+ * Uses FatFs directly, because the VFS layer doesn't expose a way to
+ * pre-allocate or truncate files. Growing a file allocates all its clusters
+ * in one go. The content of the added space is undefined. The file must not
+ * be open.
+ *
+ * @param filename	Path of file, including SDCARD_MOUNT_POINT
+ * @param size		New file size in bytes
+ *
+ * @returns	True on success, else false
+ */
+bool storage_set_file_size(const char *filename, uint32_t size);
+
+/**
+ * Make room for a new image
+ *
+ * Keeps an estimate of the free space on the SD card. If it drops below the
+ * min_free_space option, the oldest images are deleted. Only a bounded amount
+ * of files is deleted per call, so it can take multiple images to get above
+ * the minimum again. Should be called before writing every image.
+ *
+ * @param len	Size of the image that is going to be written
+ */
+void storage_reserve(size_t len);
+
+#endif // __STORAGE_H__
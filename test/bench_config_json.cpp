@@ -0,0 +1,318 @@
+/**
+ * bench_config_json.cpp - Benchmark of configAsJSON()
+ *
+ * Copyright (c) 2019, David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Counts the heap allocations and measures the time of configAsJSON(),
+ * compared with the previous implementation that concatenated Arduino Strings.
+ *
+ * The previous implementation is replayed with LegacyString, which follows the
+ * allocation behaviour of WString in arduino-esp32 1.0.6: strings of up to 11
+ * characters are stored inline, longer ones on the heap with the capacity
+ * rounded up to 16 bytes. The keys and values are taken from the output of
+ * configAsJSON(), so both produce the same JSON object.
+ *
+ * Allocations are counted by wrapping the glibc allocator.
+ *
+ * Usage: bench_config_json [ITERATIONS]
+ */
+#include <Arduino.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "configuration.h"
+
+// Default amount of iterations for the time measurement
+#define BENCH_ITERATIONS 10000
+
+// Size of the buffer used by the /config handler
+#define CONFIG_JSON_MAX 2048
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+}
+
+static bool count_allocs = false;
+static unsigned long allocs = 0;
+
+extern "C" void *malloc(size_t size)
+{
+  if (count_allocs) {
+    allocs++;
+  }
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t nmemb, size_t size)
+{
+  if (count_allocs) {
+    allocs++;
+  }
+  return __libc_calloc(nmemb, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+  if (count_allocs) {
+    allocs++;
+  }
+  return __libc_realloc(ptr, size);
+}
+
+extern "C" void free(void *ptr)
+{
+  __libc_free(ptr);
+}
+
+/**
+ * Subset of Arduino String with the same heap usage
+ */
+class LegacyString {
+public:
+  LegacyString() { init(); }
+  LegacyString(const char *cstr) { init(); concat(cstr, strlen(cstr)); }
+  LegacyString(int value) {
+    char buf[2 + 8 * sizeof(int)];
+    init();
+    concat(buf, snprintf(buf, sizeof(buf), "%d", value));
+  }
+  LegacyString(const LegacyString &str) { init(); concat(str.c_str(), str.length()); }
+  ~LegacyString() { if (!m_sso) free(m_ptr); }
+
+  LegacyString &operator +=(const LegacyString &str) {
+    concat(str.c_str(), str.length()); return *this;
+  }
+  LegacyString &operator +=(const char *cstr) {
+    concat(cstr, strlen(cstr)); return *this;
+  }
+  LegacyString &operator +=(char c) {
+    concat(&c, 1); return *this;
+  }
+
+  size_t length() const { return m_len; }
+  const char *c_str() const { return m_sso ? m_sso_buf : m_ptr; }
+
+private:
+  enum { SSO_SIZE = 12 };
+
+  void init() {
+    m_sso = true;
+    m_sso_buf[0] = '\0';
+    m_ptr = NULL;
+    m_len = 0;
+    m_cap = SSO_SIZE - 1;
+  }
+
+  bool reserve(size_t size) {
+    if (m_cap >= size) {
+      return true;
+    }
+    size_t new_size = (size + 16) & ~0xf;
+    char *buf;
+    if (m_sso) {
+      buf = (char *) malloc(new_size);
+      if (buf != NULL) {
+        memcpy(buf, m_sso_buf, m_len + 1);
+      }
+    } else {
+      buf = (char *) realloc(m_ptr, new_size);
+    }
+    if (buf == NULL) {
+      return false;
+    }
+    m_sso = false;
+    m_ptr = buf;
+    m_cap = new_size - 1;
+    return true;
+  }
+
+  void concat(const char *cstr, size_t len) {
+    if (!reserve(m_len + len)) {
+      return;
+    }
+    char *buf = m_sso ? m_sso_buf : m_ptr;
+    memcpy(&buf[m_len], cstr, len);
+    m_len += len;
+    buf[m_len] = '\0';
+  }
+
+  bool m_sso;
+  char m_sso_buf[SSO_SIZE];
+  char *m_ptr;
+  size_t m_len;
+  size_t m_cap;
+};
+
+struct JsonEntry {
+  std::string key;
+  std::string value;
+  int int_value;
+  bool is_int;
+  bool quote;
+};
+
+/**
+ * Split the output of configAsJSON() into keys and values
+ */
+static bool parse_json(const char *json, std::vector<JsonEntry> &entries)
+{
+  const char *p = json;
+
+  if (*p++ != '{') {
+    return false;
+  }
+  while (*p == '"') {
+    JsonEntry entry;
+    const char *end = strchr(++p, '"');
+    if (end == NULL || strncmp(end, "\": ", 3) != 0) {
+      return false;
+    }
+    entry.key.assign(p, end - p);
+    p = end + 3;
+    entry.quote = (*p == '"');
+    if (entry.quote) {
+      end = strchr(++p, '"');
+    } else {
+      end = p + strcspn(p, ",}");
+    }
+    if (end == NULL || *end == '\0') {
+      return false;
+    }
+    entry.value.assign(p, end - p);
+    char *int_end;
+    entry.int_value = strtol(entry.value.c_str(), &int_end, 10);
+    entry.is_int = (!entry.quote && *int_end == '\0');
+    p = end + entry.quote;
+    entries.push_back(entry);
+    if (*p == ',') {
+      p++;
+    }
+  }
+
+  return strcmp(p, "}") == 0;
+}
+
+/**
+ * Previous String based configAsJSON()
+ *
+ * optionValue() returned a String, constructed from an int for the integer
+ * values.
+ */
+static LegacyString legacy_config_as_json(const std::vector<JsonEntry> &entries)
+{
+  LegacyString json;
+
+  json += "{";
+  for (size_t i = 0; i < entries.size(); i++) {
+    const JsonEntry *entry = &entries[i];
+
+    if (json.length() > 1) {
+      json += ',';
+    }
+    json += '"';
+    json += entry->key.c_str();
+    json += "\": ";
+    if (entry->quote) {
+      json += '"';
+      json += LegacyString(entry->value.c_str());
+      json += '"';
+    } else if (entry->is_int) {
+      json += LegacyString(entry->int_value);
+    } else {
+      json += LegacyString(entry->value.c_str());
+    }
+  }
+  json += "}";
+
+  return json;
+}
+
+int main(int argc, char *argv[])
+{
+  static char buf[CONFIG_JSON_MAX];
+  unsigned int iterations = BENCH_ITERATIONS;
+  std::vector<JsonEntry> entries;
+
+  if (argc > 1) {
+    iterations = strtoul(argv[1], NULL, 0);
+  }
+  if (iterations == 0) {
+    fprintf(stderr, "Usage: %s [ITERATIONS]\n", argv[0]);
+    return 1;
+  }
+
+  size_t len = cfg.configAsJSON(buf, sizeof(buf));
+  if (len >= sizeof(buf) || !parse_json(buf, entries)) {
+    fprintf(stderr, "Could not parse configuration JSON\n");
+    return 1;
+  }
+
+  LegacyString legacy = legacy_config_as_json(entries);
+  if (strcmp(legacy.c_str(), buf) != 0) {
+    fprintf(stderr, "JSON differs:\n%s\n%s\n", buf, legacy.c_str());
+    return 1;
+  }
+
+  allocs = 0;
+  count_allocs = true;
+  cfg.configAsJSON(buf, sizeof(buf));
+  count_allocs = false;
+  unsigned long buffer_allocs = allocs;
+
+  allocs = 0;
+  count_allocs = true;
+  {
+    LegacyString json = legacy_config_as_json(entries);
+  }
+  count_allocs = false;
+  unsigned long legacy_allocs = allocs;
+
+  unsigned long start = micros();
+  for (unsigned int i = 0; i < iterations; i++) {
+    cfg.configAsJSON(buf, sizeof(buf));
+  }
+  unsigned long buffer_time = micros() - start;
+
+  start = micros();
+  for (unsigned int i = 0; i < iterations; i++) {
+    LegacyString json = legacy_config_as_json(entries);
+  }
+  unsigned long legacy_time = micros() - start;
+
+  printf("%u options, %u bytes of JSON\n", (unsigned) entries.size(),
+         (unsigned) len);
+  printf("buffer: %3lu allocations, %6.2f us per call\n", buffer_allocs,
+         (double) buffer_time / iterations);
+  printf("String: %3lu allocations, %6.2f us per call\n", legacy_allocs,
+         (double) legacy_time / iterations);
+
+  return 0;
+}
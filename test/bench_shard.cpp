@@ -0,0 +1,139 @@
+/**
+ * bench_shard.cpp - Benchmark of shard selection and file creation
+ *
+ * Copyright (c) 2019, David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Times select_shard() plus creating the image file, for every shard mode.
+ * The images are spaced 30 seconds apart, so the modes differ in the amount of
+ * files per directory. The file system is the host's, so this measures the
+ * cost of the shard handling itself, not that of FAT directory lookups.
+ *
+ * storage.cpp is included, because select_shard() is static.
+ *
+ * Usage: bench_shard [FILES]
+ */
+#include "../storage.cpp"
+
+// Default amount of files per mode
+#define BENCH_FILES 5000
+
+// Time between images
+#define BENCH_INTERVAL_SEC 30
+
+// Files per shard in count mode
+#define BENCH_SHARD_SIZE "100"
+
+// Start time: 2021-03-27 12:00:00 UTC
+#define BENCH_START_TIME 1616846400
+
+static const char *modes[] = { "none", "day", "hour", "count" };
+
+static bool bench_mode(const char *mode, unsigned int files)
+{
+  cfg.config_set("shard_mode", mode);
+  cfg.config_set("shard_size", BENCH_SHARD_SIZE);
+  if (!storage_init_capture_dir(false)) {
+    return false;
+  }
+
+  unsigned long total = 0;
+  unsigned long last_total = 0;
+  unsigned long max = 0;
+  unsigned int dirs = 0;
+  unsigned int last_cnt = files / 10;
+  time_t t = BENCH_START_TIME;
+  char prev_shard[STORAGE_SHARD_MAX] = "-";
+
+  for (unsigned int i = 0; i < files; i++, t += BENCH_INTERVAL_SEC) {
+    struct tm timeinfo;
+    localtime_r(&t, &timeinfo);
+
+    unsigned long start = micros();
+    if (!select_shard(&timeinfo)) {
+      return false;
+    }
+    char filename[STORAGE_PATH_MAX];
+    size_t path_len = snprintf(filename, sizeof(filename), "%s%s",
+                               capture_path, storage_state.shard);
+    strftime(&filename[path_len], sizeof(filename) - path_len,
+             "/%Y%m%d_%H%M%S.jpg", &timeinfo);
+    FILE *file = fopen(filename, "w");
+    if (file == NULL) {
+      Serial.printf("Could not open file: %s\n", filename);
+      return false;
+    }
+    fclose(file);
+    unsigned long elapsed = micros() - start;
+
+    storage_state.shard_files++;
+    if (strcmp(prev_shard, storage_state.shard) != 0) {
+      strcpy(prev_shard, storage_state.shard);
+      dirs++;
+    }
+
+    total += elapsed;
+    if (i >= files - last_cnt) {
+      last_total += elapsed;
+    }
+    if (elapsed > max) {
+      max = elapsed;
+    }
+  }
+
+  printf("%-6s %5u files %4u dirs: avg %5.1f us, last %u avg %5.1f us, "
+         "max %5lu us\n", mode, files, dirs, (double) total / files,
+         last_cnt, (double) last_total / last_cnt, max);
+
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned int files = BENCH_FILES;
+
+  if (argc > 1) {
+    files = strtoul(argv[1], NULL, 0);
+  }
+  if (files < 10) {
+    fprintf(stderr, "Usage: %s [FILES], at least 10 files\n", argv[0]);
+    return 1;
+  }
+
+  setenv("TZ", "GMT0", 1);
+  tzset();
+
+  if (!storage_init()) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+    if (!bench_mode(modes[i], files)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,215 @@
+/**
+ * fake_camera.cpp - Camera that returns fixture JPEGs
+ *
+ * Copyright (c) 2019, David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+
+#include "Arduino.h"
+
+#include "esp_camera.h"
+
+#include "camera.h"
+#include "configuration.h"
+#include "jpeg.h"
+#include "host.h"
+
+// Maximum amount of fixture frames
+#define FAKE_CAMERA_FRAMES_MAX 16
+
+// Simulated time it takes to capture a frame
+#define FAKE_CAMERA_CAPTURE_USEC 150000
+
+// JPEG SOF0 marker, holds the image size
+#define JPEG_MARKER_SOF0 0xc0
+
+static struct {
+  uint8_t *buf;
+  size_t len;
+  uint16_t width;
+  uint16_t height;
+} frames[FAKE_CAMERA_FRAMES_MAX];
+static unsigned int frame_cnt = 0;
+static unsigned int frame_next = 0;
+
+static camera_fb_t fake_fb;
+static bool fake_fb_taken = false;
+
+/**
+ * Get image size from SOF0 segment
+ *
+ * The fixtures are small, a linear search for the marker is good enough.
+ */
+static bool get_frame_size(const uint8_t *buf, size_t len,
+                           uint16_t *width, uint16_t *height)
+{
+  for (size_t i = 2; i + 9 <= len; i++) {
+    if (buf[i] == 0xff && buf[i + 1] == JPEG_MARKER_SOF0) {
+      *height = buf[i + 5] << 8 | buf[i + 6];
+      *width = buf[i + 7] << 8 | buf[i + 8];
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool host_camera_add_frame(const char *path)
+{
+  if (frame_cnt >= FAKE_CAMERA_FRAMES_MAX) {
+    Serial.println("Too many fixture frames");
+    return false;
+  }
+
+  size_t len;
+  uint8_t *buf = host_read_file(path, &len);
+  if (buf == NULL) {
+    Serial.printf("Could not read fixture: %s\n", path);
+    return false;
+  }
+
+  frames[frame_cnt].buf = buf;
+  frames[frame_cnt].len = len;
+  if (!get_frame_size(buf, len, &frames[frame_cnt].width,
+                      &frames[frame_cnt].height)) {
+    // Invalid frames are part of the fixtures, to test dropping them
+    frames[frame_cnt].width = 0;
+    frames[frame_cnt].height = 0;
+  }
+  frame_cnt++;
+
+  return true;
+}
+
+bool camera_init()
+{
+  fake_fb_taken = false;
+
+  return frame_cnt != 0;
+}
+
+void camera_deinit()
+{
+}
+
+void camera_standby(bool enable)
+{
+  (void) enable;
+}
+
+bool camera_reconfigure(bool force)
+{
+  (void) force;
+
+  return true;
+}
+
+/**
+ * Capture a valid JPEG frame
+ *
+ * Like the real camera invalid frames are dropped, but only one round over
+ * all fixtures is tried.
+ */
+camera_fb_t *camera_capture(bool do_train)
+{
+  (void) do_train;
+
+  if (fake_fb_taken || frame_cnt == 0) {
+    return NULL;
+  }
+
+  for (unsigned int attempt = 0; attempt < frame_cnt; attempt++) {
+    unsigned int idx = frame_next;
+    frame_next = (frame_next + 1) % frame_cnt;
+    host_advance_time(FAKE_CAMERA_CAPTURE_USEC);
+
+    jpeg_info_t info;
+    if (jpeg_parse(frames[idx].buf, frames[idx].len, &info) != JPEG_OK) {
+      Serial.printf("Invalid frame (%s), ", jpeg_strerror(info.status));
+      continue;
+    }
+
+    // The frame buffer is writable on the ESP32, give out a copy
+    fake_fb.buf = (uint8_t *) malloc(info.len);
+    if (fake_fb.buf == NULL) {
+      return NULL;
+    }
+    memcpy(fake_fb.buf, frames[idx].buf, info.len);
+    fake_fb.len = info.len;
+    fake_fb.width = frames[idx].width;
+    fake_fb.height = frames[idx].height;
+    fake_fb.format = PIXFORMAT_JPEG;
+    host_get_time(&fake_fb.timestamp);
+    fake_fb_taken = true;
+
+    return &fake_fb;
+  }
+
+  return NULL;
+}
+
+bool camera_probe(uint8_t *grid)
+{
+  (void) grid;
+
+  return false;
+}
+
+bool camera_get_frame_info(const camera_fb_t *fb, camera_frame_info_t *info)
+{
+  (void) fb;
+
+  memset(info, 0, sizeof(*info));
+  info->exposure_us = 10000;
+  info->iso = 100;
+  info->brightness = 500;
+
+  return true;
+}
+
+// The first fixture is used as thumbnail
+bool camera_get_thumbnail(const camera_fb_t *fb,
+                          const uint8_t **buf, size_t *len)
+{
+  (void) fb;
+
+  if (cfg.getThumbnail() == Configuration::ThumbnailNone || frame_cnt == 0) {
+    return false;
+  }
+
+  *buf = frames[0].buf;
+  *len = frames[0].len;
+
+  return true;
+}
+
+void camera_fb_return(camera_fb_t *buf)
+{
+  if (buf == &fake_fb && fake_fb_taken) {
+    free(fake_fb.buf);
+    fake_fb.buf = NULL;
+    fake_fb_taken = false;
+  }
+}
@@ -0,0 +1,174 @@
+/**
+ * fuzz_jpeg.cpp - Fuzz target of the JPEG marker walker
+ *
+ * Copyright (c) 2019, David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Runs jpeg_parse() and jpeg_skip_headers() on the input, and checks that
+ * the results stay within the input. Build with -fsanitize=address,undefined
+ * to also catch out of bounds reads.
+ *
+ * With libFuzzer (JPEG_FUZZ_LIBFUZZER defined) this is only the fuzz target.
+ * Else main() replays the given corpus files and directories. Every prefix of
+ * each file is tried too, as if the frame was truncated.
+ *
+ * Usage: fuzz_jpeg FILE|DIR...
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jpeg.h"
+
+#ifndef JPEG_FUZZ_LIBFUZZER
+# include <dirent.h>
+# include <sys/stat.h>
+#endif // JPEG_FUZZ_LIBFUZZER
+
+#define JPEG_MARKER_EOI 0xd9
+
+#define FUZZ_CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+              #cond); \
+      abort(); \
+    } \
+  } while (0)
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  // Exact size copy, so the sanitizer catches reads beyond the end
+  uint8_t *buf = (uint8_t *) malloc(size != 0 ? size : 1);
+  memcpy(buf, data, size);
+
+  jpeg_info_t info;
+  jpeg_status_t status = jpeg_parse(buf, size, &info);
+  FUZZ_CHECK(status == info.status);
+  FUZZ_CHECK(jpeg_strerror(status) != NULL);
+  if (status == JPEG_OK) {
+    FUZZ_CHECK(info.len >= 4 && info.len <= size);
+    FUZZ_CHECK(buf[info.len - 2] == 0xff &&
+               buf[info.len - 1] == JPEG_MARKER_EOI);
+    FUZZ_CHECK(info.data_offset >= 2 && info.data_offset < info.len);
+  }
+
+  size_t offset = jpeg_skip_headers(buf, size);
+  FUZZ_CHECK(offset == 0 || (offset >= 2 && offset < size));
+  if (status == JPEG_OK) {
+    // Both walk the same header segments, but jpeg_parse() also skips
+    // standalone markers
+    FUZZ_CHECK(offset != 0 && offset <= info.data_offset);
+  }
+
+  free(buf);
+
+  return 0;
+}
+
+#ifndef JPEG_FUZZ_LIBFUZZER
+static bool replay_file(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open %s\n", path);
+    return false;
+  }
+
+  uint8_t *buf = NULL;
+  size_t len = 0;
+  size_t size = 0;
+  size_t ret;
+  do {
+    if (len == size) {
+      size = (size == 0) ? 4096 : size * 2;
+      buf = (uint8_t *) realloc(buf, size);
+    }
+    ret = fread(&buf[len], 1, size - len, file);
+    len += ret;
+  } while (ret != 0);
+  fclose(file);
+
+  for (size_t i = 0; i <= len; i++) {
+    LLVMFuzzerTestOneInput(buf, i);
+  }
+  free(buf);
+
+  return true;
+}
+
+static bool replay_path(const char *path, unsigned int *count)
+{
+  struct stat st;
+
+  if (stat(path, &st) != 0) {
+    fprintf(stderr, "Could not stat %s\n", path);
+    return false;
+  }
+
+  if (!S_ISDIR(st.st_mode)) {
+    (*count)++;
+    return replay_file(path);
+  }
+
+  DIR *dirp = opendir(path);
+  struct dirent *dp;
+  bool retval = (dirp != NULL);
+  while (retval && (dp = readdir(dirp)) != NULL) {
+    char sub_path[1024];
+    if (dp->d_name[0] == '.') {
+      continue;
+    }
+    snprintf(sub_path, sizeof(sub_path), "%s/%s", path, dp->d_name);
+    retval = replay_path(sub_path, count);
+  }
+  if (dirp != NULL) {
+    closedir(dirp);
+  }
+
+  return retval;
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned int count = 0;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s FILE|DIR...\n", argv[0]);
+    return 1;
+  }
+
+  for (int i = 1; i < argc; i++) {
+    if (!replay_path(argv[i], &count)) {
+      return 1;
+    }
+  }
+
+  printf("fuzz_jpeg: replayed %u inputs\n", count);
+
+  return 0;
+}
+#endif // JPEG_FUZZ_LIBFUZZER
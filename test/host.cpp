@@ -0,0 +1,341 @@
+/**
+ * host.cpp - Host implementation of the ESP32 and Arduino stubs
+ *
+ * Copyright (c) 2019, David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+
+#include "Arduino.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "esp_heap_caps.h"
+#include "esp_sleep.h"
+#include "esp_vfs_fat.h"
+#include "ff.h"
+#include "rom/crc.h"
+
+#include "host.h"
+
+// Sectors per cluster of the simulated file system, 32 KiB clusters like an
+// SDHC card formatted with the default allocation unit size.
+#define HOST_CLUSTER_SECTORS 64
+
+HardwareSerial Serial;
+
+static struct timeval host_time;
+static uint64_t host_wakeup_usec;
+static esp_sleep_wakeup_cause_t host_wakeup_cause = ESP_SLEEP_WAKEUP_UNDEFINED;
+static FATFS host_fs = { HOST_CLUSTER_SECTORS };
+
+/************************ Arduino ************************/
+size_t HardwareSerial::print(const char *str)
+{
+  return fputs(str, stdout);
+}
+
+size_t HardwareSerial::println(const char *str)
+{
+  return printf("%s\n", str);
+}
+
+size_t HardwareSerial::printf(const char *fmt, ...)
+{
+  va_list ap;
+
+  va_start(ap, fmt);
+  int ret = vprintf(fmt, ap);
+  va_end(ap);
+
+  return ret < 0 ? 0 : ret;
+}
+
+void HardwareSerial::flush()
+{
+  fflush(stdout);
+}
+
+// Timing functions use the real clock, so measurements are meaningful
+unsigned long micros()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long) ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+unsigned long millis()
+{
+  return micros() / 1000;
+}
+
+/************************ Simulated clock ************************/
+void host_get_time(struct timeval *tv)
+{
+  *tv = host_time;
+}
+
+void host_set_time(time_t sec)
+{
+  host_time.tv_sec = sec;
+  host_time.tv_usec = 0;
+}
+
+void host_advance_time(uint64_t usec)
+{
+  struct timeval delta = {
+    (time_t) (usec / 1000000),
+    (suseconds_t) (usec % 1000000)
+  };
+  timeradd(&host_time, &delta, &host_time);
+}
+
+uint8_t *host_read_file(const char *path, size_t *len)
+{
+  FILE *file = fopen(path, "rb");
+  uint8_t *buf = NULL;
+  long size;
+
+  if (file == NULL) {
+    return NULL;
+  }
+  if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 0 ||
+      fseek(file, 0, SEEK_SET) != 0) {
+    goto fail;
+  }
+  buf = (uint8_t *) malloc(size > 0 ? size : 1);
+  if (buf == NULL || fread(buf, 1, size, file) != (size_t) size) {
+    free(buf);
+    buf = NULL;
+    goto fail;
+  }
+  *len = size;
+
+fail:
+  fclose(file);
+
+  return buf;
+}
+
+/************************ ESP-IDF ************************/
+const char *esp_err_to_name(esp_err_t code)
+{
+  return code == ESP_OK ? "ESP_OK" : "ESP_FAIL";
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+  (void) caps;
+  return malloc(size);
+}
+
+uint32_t crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+  crc = ~crc;
+  while (len--) {
+    crc ^= *buf++;
+    for (int i = 0; i < 8; i++) {
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause()
+{
+  return host_wakeup_cause;
+}
+
+esp_err_t esp_sleep_enable_timer_wakeup(uint64_t time_in_us)
+{
+  host_wakeup_usec = time_in_us;
+  return ESP_OK;
+}
+
+esp_err_t esp_light_sleep_start()
+{
+  host_advance_time(host_wakeup_usec);
+  return ESP_OK;
+}
+
+void esp_deep_sleep_start()
+{
+  host_advance_time(host_wakeup_usec);
+  host_wakeup_cause = ESP_SLEEP_WAKEUP_TIMER;
+}
+
+esp_err_t esp_vfs_fat_sdmmc_mount(const char *base_path,
+                                  const sdmmc_host_t *host_config,
+                                  const void *slot_config,
+                                  const esp_vfs_fat_sdmmc_mount_config_t *mount_config,
+                                  sdmmc_card_t **out_card)
+{
+  static sdmmc_card_t card;
+  char path[256];
+
+  (void) host_config;
+  (void) slot_config;
+  (void) mount_config;
+
+  // Create the directory the mount point maps to, including parents
+  snprintf(path, sizeof(path), "%s", base_path);
+  for (char *p = &path[1]; ; p++) {
+    if (*p == '/' || *p == '\0') {
+      char c = *p;
+      *p = '\0';
+      if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+        return ESP_FAIL;
+      }
+      *p = c;
+      if (c == '\0') {
+        break;
+      }
+    }
+  }
+
+  *out_card = &card;
+
+  return ESP_OK;
+}
+
+/************************ FatFs ************************/
+/**
+ * Map FatFs path on drive 0: to the host directory of SDCARD_MOUNT_POINT
+ */
+static void host_ff_path(const TCHAR *path, char *buf, size_t size)
+{
+  if (strncmp(path, "0:", 2) == 0) {
+    path += 2;
+  }
+  snprintf(buf, size, "%s%s", SDCARD_MOUNT_POINT, path);
+}
+
+FRESULT f_open(FIL *fp, const TCHAR *path, BYTE mode)
+{
+  char host_path[256];
+  struct stat st;
+  int flags = (mode & FA_WRITE) ? O_RDWR : O_RDONLY;
+
+  if (mode & FA_CREATE_ALWAYS) {
+    flags |= O_CREAT | O_TRUNC;
+  }
+
+  host_ff_path(path, host_path, sizeof(host_path));
+  fp->fd = open(host_path, flags, 0666);
+  if (fp->fd < 0) {
+    return errno == ENOENT ? FR_NO_FILE : FR_DENIED;
+  }
+  if (fstat(fp->fd, &st) != 0) {
+    close(fp->fd);
+    return FR_DISK_ERR;
+  }
+
+  fp->obj.fs = &host_fs;
+  fp->obj.objsize = st.st_size;
+  fp->flag = mode;
+  fp->fptr = 0;
+
+  return FR_OK;
+}
+
+FRESULT f_close(FIL *fp)
+{
+  int ret = close(fp->fd);
+  fp->fd = -1;
+
+  return ret == 0 ? FR_OK : FR_DISK_ERR;
+}
+
+FRESULT f_write(FIL *fp, const void *buff, UINT btw, UINT *bw)
+{
+  ssize_t ret = pwrite(fp->fd, buff, btw, fp->fptr);
+  if (ret < 0) {
+    *bw = 0;
+    return FR_DISK_ERR;
+  }
+
+  *bw = ret;
+  fp->fptr += ret;
+  if (fp->fptr > fp->obj.objsize) {
+    fp->obj.objsize = fp->fptr;
+  }
+
+  return FR_OK;
+}
+
+FRESULT f_lseek(FIL *fp, FSIZE_t ofs)
+{
+  // Expand file when seeking beyond its end in write mode
+  if (ofs > fp->obj.objsize) {
+    if (!(fp->flag & FA_WRITE)) {
+      ofs = fp->obj.objsize;
+    } else if (ftruncate(fp->fd, ofs) != 0) {
+      return FR_DISK_ERR;
+    } else {
+      fp->obj.objsize = ofs;
+    }
+  }
+  fp->fptr = ofs;
+
+  return FR_OK;
+}
+
+FRESULT f_truncate(FIL *fp)
+{
+  if (!(fp->flag & FA_WRITE)) {
+    return FR_DENIED;
+  }
+  if (ftruncate(fp->fd, fp->fptr) != 0) {
+    return FR_DISK_ERR;
+  }
+  fp->obj.objsize = fp->fptr;
+
+  return FR_OK;
+}
+
+FRESULT f_sync(FIL *fp)
+{
+  return fsync(fp->fd) == 0 ? FR_OK : FR_DISK_ERR;
+}
+
+FRESULT f_getfree(const TCHAR *path, DWORD *nclst, FATFS **fatfs)
+{
+  struct statvfs st;
+
+  (void) path;
+
+  if (statvfs(SDCARD_MOUNT_POINT, &st) != 0) {
+    return FR_DISK_ERR;
+  }
+  *nclst = (uint64_t) st.f_bavail * st.f_frsize /
+           (HOST_CLUSTER_SECTORS * FF_MAX_SS);
+  *fatfs = &host_fs;
+
+  return FR_OK;
+}
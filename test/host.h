@@ -0,0 +1,74 @@
+/**
+ * host.h - Simulated clock and helpers of the host test build
+ *
+ * Copyright (c) 2019, David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __HOST_H__
+#define __HOST_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/time.h>
+
+/**
+ * Get simulated wall clock time
+ *
+ * The simulated clock only advances through host_advance_time(), and by
+ * sleeping with the esp_sleep.h functions.
+ */
+void host_get_time(struct timeval *tv);
+
+/**
+ * Set simulated wall clock time
+ */
+void host_set_time(time_t sec);
+
+/**
+ * Advance simulated wall clock
+ */
+void host_advance_time(uint64_t usec);
+
+/**
+ * Read whole file into a newly allocated buffer
+ *
+ * @param path	File to read
+ * @param len	Used to return the file size
+ *
+ * @returns	Buffer to be freed with free(), or NULL on error
+ */
+uint8_t *host_read_file(const char *path, size_t *len);
+
+/**
+ * Add fixture JPEG to the frames returned by the fake camera
+ *
+ * Frames are returned in the order they were added, after the last frame the
+ * camera starts again with the first one.
+ *
+ * @returns	True on success, else false
+ */
+bool host_camera_add_frame(const char *path);
+
+#endif // __HOST_H__
@@ -0,0 +1,364 @@
+/**
+ * sim.cpp - Simulated capture loop on the host
+ *
+ * Copyright (c) 2019, David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Runs the capture loop of the firmware against the host stubs: the fake
+ * camera returns fixture JPEGs, the SD card is a directory on the host and
+ * sleeping advances a simulated clock. Deep sleep is simulated by running the
+ * set-up again, with the state in RTC memory kept.
+ *
+ * Afterwards all images on the simulated SD card are validated and counted.
+ *
+ * Usage: sim [-n CAPTURES] [-s START_TIME] FIXTURE...
+ */
+#include "config.h"
+
+#include "Arduino.h"
+
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "esp_camera.h"
+#include "esp_sleep.h"
+
+#include "avi.h"
+#include "camera.h"
+#include "configuration.h"
+#include "exif.h"
+#include "jpeg.h"
+#include "schedule.h"
+#include "storage.h"
+#include "host.h"
+
+// Time unit defines
+#define MSEC_AS_USEC (1000L)
+#define SEC_AS_USEC (1000L * MSEC_AS_USEC)
+
+// Wake-up lead time and thresholds, as used by the firmware before the
+// wake-up latency is measured
+#define SIM_WAKE_USEC_EARLY (1 * SEC_AS_USEC)
+#define SIM_MIN_SLEEP_TIME (1 * SEC_AS_USEC)
+#define SIM_LIGHT_SLEEP_MIN_TIME (200 * MSEC_AS_USEC)
+#define SIM_LIGHT_WAKE_USEC_EARLY (100 * MSEC_AS_USEC)
+
+// Default simulation start: 2021-03-27 12:00:00 UTC
+#define SIM_START_TIME 1616846400
+
+// Give up if this many loop iterations pass without a capture
+#define SIM_IDLE_LOOPS_MAX 10000
+
+// Offset of total frame count in AVI file
+#define AVI_TOTAL_FRAMES_OFFSET 48
+
+// RTC memory storage
+RTC_DATA_ATTR static struct timeval nv_next_capture_time;
+
+static struct timeval next_capture_time;
+static unsigned int captures = 0;
+static unsigned int deep_sleeps = 0;
+static unsigned int light_sleeps = 0;
+
+static void write_photo(camera_fb_t *fb, const struct timeval *tv)
+{
+  const uint8_t *exif_header = NULL;
+  size_t exif_len = 0;
+  get_exif_header(fb, tv, &exif_header, &exif_len);
+
+  size_t data_offset = get_jpeg_data_offset(fb);
+  if (exif_header == NULL) {
+    exif_len = 0;
+    data_offset = 0;
+  }
+
+  bool success;
+  storage_reserve(exif_len + fb->len - data_offset);
+  if (cfg.getOutputFormat() == Configuration::OutputFormatAvi) {
+    success = avi_add_frame(exif_header, exif_len,
+                            &fb->buf[data_offset], fb->len - data_offset,
+                            fb->width, fb->height);
+    if (success) {
+      Serial.printf("Appended to %s\n", avi_get_path());
+    }
+  } else {
+    success = storage_write_jpeg(tv, exif_header, exif_len,
+                                 &fb->buf[data_offset], fb->len - data_offset);
+  }
+  if (success) {
+    captures++;
+  }
+
+  camera_fb_return(fb);
+}
+
+static bool sim_setup()
+{
+  bool is_wakeup = (esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_UNDEFINED);
+
+  if (!storage_init()) {
+    return false;
+  }
+  if (!cfg.loadConfig()) {
+    return false;
+  }
+  update_exif_from_cfg(cfg);
+
+  setenv("TZ", cfg.getTzInfo(), 1);
+  tzset();
+
+  if (is_wakeup) {
+    next_capture_time = nv_next_capture_time;
+  } else {
+    host_get_time(&next_capture_time);
+    schedule_adjust(&next_capture_time);
+  }
+
+  if (!storage_init_capture_dir(is_wakeup)) {
+    return false;
+  }
+  if (cfg.getOutputFormat() == Configuration::OutputFormatAvi) {
+    if (!avi_open(storage_get_capture_path())) {
+      return false;
+    }
+  }
+
+  return camera_init();
+}
+
+/**
+ * Run one iteration of the capture loop
+ *
+ * @returns	True if the device went into deep sleep
+ */
+static bool sim_loop()
+{
+  struct timeval now;
+
+  host_get_time(&now);
+  if (!timercmp(&now, &next_capture_time, <)) {
+    Configuration::MissedCapture missed_capture = cfg.getMissedCapture();
+    struct timeval following = next_capture_time;
+    schedule_next(&following);
+    bool missed = !timercmp(&now, &following, <);
+
+    if (schedule_active(&next_capture_time) &&
+        !(missed && missed_capture == Configuration::MissedCaptureSkip)) {
+      camera_fb_t *fb = camera_capture(true);
+      if (fb != NULL) {
+        struct timeval tv;
+        host_get_time(&tv);
+        write_photo(fb, &tv);
+      } else {
+        Serial.println("Failed\nCamera capture failed");
+      }
+    }
+
+    host_get_time(&now);
+    if (missed_capture != Configuration::MissedCaptureCatchUp &&
+        !timercmp(&now, &following, <)) {
+      schedule_skip(&following, &now);
+    }
+    next_capture_time = following;
+  }
+
+  host_get_time(&now);
+  if (!timercmp(&now, &next_capture_time, <)) {
+    return false;
+  }
+
+  struct timeval time_to_next_capture;
+  timersub(&next_capture_time, &now, &time_to_next_capture);
+  uint64_t capture_wait = ((uint64_t) time_to_next_capture.tv_sec) *
+                          SEC_AS_USEC + time_to_next_capture.tv_usec;
+  Configuration::SleepMode sleep_mode = cfg.getSleepMode();
+
+  uint64_t sleep_time = 0;
+  if (capture_wait > SIM_WAKE_USEC_EARLY) {
+    sleep_time = capture_wait - SIM_WAKE_USEC_EARLY;
+  }
+
+  if ((sleep_mode == Configuration::SleepModeAuto ||
+       sleep_mode == Configuration::SleepModeDeep) &&
+      sleep_time >= SIM_MIN_SLEEP_TIME) {
+    nv_next_capture_time = next_capture_time;
+    camera_deinit();
+    esp_sleep_enable_timer_wakeup(sleep_time);
+    esp_deep_sleep_start();
+    // Waking up takes the lead time
+    host_advance_time(SIM_WAKE_USEC_EARLY);
+    deep_sleeps++;
+    return true;
+  } else if ((sleep_mode == Configuration::SleepModeAuto ||
+              sleep_mode == Configuration::SleepModeLight) &&
+             capture_wait >= SIM_LIGHT_SLEEP_MIN_TIME) {
+    camera_standby(true);
+    esp_sleep_enable_timer_wakeup(capture_wait - SIM_LIGHT_WAKE_USEC_EARLY);
+    esp_light_sleep_start();
+    host_advance_time(SIM_LIGHT_WAKE_USEC_EARLY);
+    camera_standby(false);
+    light_sleeps++;
+  } else {
+    // Stay awake
+    host_advance_time(capture_wait);
+  }
+
+  return false;
+}
+
+/**
+ * Count valid images below directory
+ *
+ * @returns	Amount of images, or -1 if an invalid image was found
+ */
+static int count_images(const char *path)
+{
+  DIR *dirp = opendir(path);
+  struct dirent *dp;
+  int count = 0;
+
+  if (dirp == NULL) {
+    return -1;
+  }
+
+  while (count >= 0 && (dp = readdir(dirp)) != NULL) {
+    char sub_path[512];
+    struct stat st;
+    size_t len = strlen(dp->d_name);
+
+    if (dp->d_name[0] == '.') {
+      continue;
+    }
+    snprintf(sub_path, sizeof(sub_path), "%s/%s", path, dp->d_name);
+    if (stat(sub_path, &st) != 0) {
+      count = -1;
+    } else if (S_ISDIR(st.st_mode)) {
+      int ret = count_images(sub_path);
+      count = (ret < 0) ? -1 : count + ret;
+    } else if (len > 4 && strcmp(&dp->d_name[len - 4], ".jpg") == 0) {
+      size_t buf_len;
+      uint8_t *buf = host_read_file(sub_path, &buf_len);
+      jpeg_info_t info;
+      if (buf == NULL || jpeg_parse(buf, buf_len, &info) != JPEG_OK ||
+          info.len != buf_len) {
+        printf("Invalid image: %s\n", sub_path);
+        count = -1;
+      } else {
+        count++;
+      }
+      free(buf);
+    } else if (len > 4 && strcmp(&dp->d_name[len - 4], ".avi") == 0) {
+      size_t buf_len;
+      uint8_t *buf = host_read_file(sub_path, &buf_len);
+      uint32_t frames;
+      if (buf == NULL || buf_len < AVI_TOTAL_FRAMES_OFFSET + sizeof(frames) ||
+          memcmp(buf, "RIFF", 4) != 0) {
+        printf("Invalid AVI file: %s\n", sub_path);
+        count = -1;
+      } else {
+        memcpy(&frames, &buf[AVI_TOTAL_FRAMES_OFFSET], sizeof(frames));
+        count += frames;
+      }
+      free(buf);
+    }
+  }
+
+  closedir(dirp);
+
+  return count;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-n CAPTURES] [-s START_TIME] FIXTURE...\n",
+          name);
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned int capture_cnt = 20;
+  time_t start_time = SIM_START_TIME;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+    switch (opt) {
+    case 'n':
+      capture_cnt = strtoul(optarg, NULL, 0);
+      break;
+    case 's':
+      start_time = strtoll(optarg, NULL, 0);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind >= argc) {
+    usage(argv[0]);
+    return 1;
+  }
+  for (int i = optind; i < argc; i++) {
+    if (!host_camera_add_frame(argv[i])) {
+      return 1;
+    }
+  }
+
+  host_set_time(start_time);
+
+  unsigned int idle_loops = 0;
+  unsigned int last_captures = 0;
+  bool need_setup = true;
+  while (captures < capture_cnt) {
+    if (need_setup && !sim_setup()) {
+      printf("Set-up failed\n");
+      return 1;
+    }
+    need_setup = sim_loop();
+
+    if (captures != last_captures) {
+      last_captures = captures;
+      idle_loops = 0;
+    } else if (++idle_loops > SIM_IDLE_LOOPS_MAX) {
+      printf("No captures for %u iterations\n", SIM_IDLE_LOOPS_MAX);
+      return 1;
+    }
+  }
+
+  // Closes the AVI file
+  avi_finalize();
+
+  struct timeval end_time;
+  host_get_time(&end_time);
+  printf("Simulated %u captures in %ld s, %u deep sleeps, %u light sleeps\n",
+         captures, (long) (end_time.tv_sec - start_time),
+         deep_sleeps, light_sleeps);
+
+  int found = count_images(SDCARD_MOUNT_POINT);
+  printf("Found %d valid images on SD card\n", found);
+
+  return (found == (int) captures) ? 0 : 1;
+}
@@ -0,0 +1,31 @@
+/**
+ * Arduino.h - Host stub of the Arduino core, only what the tested modules use
+ */
+#ifndef __ARDUINO_H__
+#define __ARDUINO_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_attr.h"
+#include "esp_system.h"
+
+#define PROGMEM
+
+class HardwareSerial {
+public:
+  size_t print(const char *str);
+  size_t println(const char *str="");
+  size_t printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+  void flush();
+};
+
+extern HardwareSerial Serial;
+
+unsigned long millis();
+unsigned long micros();
+
+#endif // __ARDUINO_H__
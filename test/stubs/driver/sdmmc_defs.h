@@ -0,0 +1,3 @@
+/**
+ * driver/sdmmc_defs.h - Host stub
+ */
@@ -0,0 +1,21 @@
+/**
+ * driver/sdmmc_host.h - Host stub
+ */
+#ifndef __SDMMC_HOST_H__
+#define __SDMMC_HOST_H__
+
+#define SDMMC_HOST_FLAG_1BIT 1
+#define SDMMC_HOST_FLAG_4BIT 2
+
+typedef struct {
+  int flags;
+} sdmmc_host_t;
+
+typedef struct {
+  int width;
+} sdmmc_slot_config_t;
+
+#define SDMMC_HOST_DEFAULT() { SDMMC_HOST_FLAG_4BIT }
+#define SDMMC_SLOT_CONFIG_DEFAULT() { 4 }
+
+#endif // __SDMMC_HOST_H__
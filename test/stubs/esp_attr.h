@@ -0,0 +1,11 @@
+/**
+ * esp_attr.h - Host stub, RTC memory is ordinary memory on the host
+ */
+#ifndef __ESP_ATTR_H__
+#define __ESP_ATTR_H__
+
+#define RTC_DATA_ATTR
+#define RTC_NOINIT_ATTR
+#define IRAM_ATTR
+
+#endif // __ESP_ATTR_H__
@@ -0,0 +1,15 @@
+/**
+ * esp_heap_caps.h - Host stub, all memory is ordinary heap memory
+ */
+#ifndef __ESP_HEAP_CAPS_H__
+#define __ESP_HEAP_CAPS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+
+void *heap_caps_malloc(size_t size, uint32_t caps);
+
+#endif // __ESP_HEAP_CAPS_H__
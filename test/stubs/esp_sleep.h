@@ -0,0 +1,30 @@
+/**
+ * esp_sleep.h - Host stub
+ *
+ * Sleeping advances the simulated clock, see host.h.
+ */
+#ifndef __ESP_SLEEP_H__
+#define __ESP_SLEEP_H__
+
+#include <stdint.h>
+
+#include "esp_system.h"
+
+typedef enum {
+  ESP_SLEEP_WAKEUP_UNDEFINED,
+  ESP_SLEEP_WAKEUP_TIMER,
+} esp_sleep_wakeup_cause_t;
+
+esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause();
+esp_err_t esp_sleep_enable_timer_wakeup(uint64_t time_in_us);
+esp_err_t esp_light_sleep_start();
+
+/**
+ * Enter deep sleep
+ *
+ * Unlike on the ESP32 this returns, after which the caller should simulate a
+ * reset by running its setup again.
+ */
+void esp_deep_sleep_start();
+
+#endif // __ESP_SLEEP_H__
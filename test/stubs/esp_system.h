@@ -0,0 +1,16 @@
+/**
+ * esp_system.h - Host stub
+ */
+#ifndef __ESP_SYSTEM_H__
+#define __ESP_SYSTEM_H__
+
+#include <stdint.h>
+
+typedef int32_t esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+const char *esp_err_to_name(esp_err_t code);
+
+#endif // __ESP_SYSTEM_H__
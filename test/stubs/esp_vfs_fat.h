@@ -0,0 +1,28 @@
+/**
+ * esp_vfs_fat.h - Host stub
+ *
+ * Mounting creates the directory SDCARD_MOUNT_POINT maps to.
+ */
+#ifndef __ESP_VFS_FAT_H__
+#define __ESP_VFS_FAT_H__
+
+#include <stddef.h>
+
+#include "esp_system.h"
+#include "driver/sdmmc_host.h"
+#include "sdmmc_cmd.h"
+#include "ff.h"
+
+typedef struct {
+  bool format_if_mount_failed;
+  int max_files;
+  size_t allocation_unit_size;
+} esp_vfs_fat_sdmmc_mount_config_t;
+
+esp_err_t esp_vfs_fat_sdmmc_mount(const char *base_path,
+                                  const sdmmc_host_t *host_config,
+                                  const void *slot_config,
+                                  const esp_vfs_fat_sdmmc_mount_config_t *mount_config,
+                                  sdmmc_card_t **out_card);
+
+#endif // __ESP_VFS_FAT_H__
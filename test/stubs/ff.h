@@ -0,0 +1,61 @@
+/**
+ * ff.h - Host stub of FatFs, backed by POSIX files
+ *
+ * Paths on drive "0:" map to SDCARD_MOUNT_POINT. Seeking beyond the end of a
+ * file opened for writing expands it, like FatFs does.
+ */
+#ifndef __FF_H__
+#define __FF_H__
+
+#include <stdint.h>
+
+typedef uint8_t BYTE;
+typedef unsigned int UINT;
+typedef uint32_t DWORD;
+typedef uint32_t FSIZE_t;
+typedef char TCHAR;
+
+#define FF_MIN_SS 512
+#define FF_MAX_SS 512
+
+typedef struct {
+  BYTE csize; /**< Sectors per cluster */
+} FATFS;
+
+typedef struct {
+  FATFS *fs;
+  FSIZE_t objsize;
+} FFOBJID;
+
+typedef struct {
+  FFOBJID obj;
+  BYTE flag;
+  FSIZE_t fptr;
+  int fd;
+} FIL;
+
+typedef enum {
+  FR_OK = 0,
+  FR_DISK_ERR,
+  FR_NO_FILE = 4,
+  FR_DENIED = 7,
+  FR_INVALID_OBJECT = 9,
+} FRESULT;
+
+#define FA_READ 0x01
+#define FA_WRITE 0x02
+#define FA_OPEN_EXISTING 0x00
+#define FA_CREATE_ALWAYS 0x08
+
+FRESULT f_open(FIL *fp, const TCHAR *path, BYTE mode);
+FRESULT f_close(FIL *fp);
+FRESULT f_write(FIL *fp, const void *buff, UINT btw, UINT *bw);
+FRESULT f_lseek(FIL *fp, FSIZE_t ofs);
+FRESULT f_truncate(FIL *fp);
+FRESULT f_sync(FIL *fp);
+FRESULT f_getfree(const TCHAR *path, DWORD *nclst, FATFS **fatfs);
+
+#define f_tell(fp) ((fp)->fptr)
+#define f_size(fp) ((fp)->obj.objsize)
+
+#endif // __FF_H__
@@ -0,0 +1,11 @@
+/**
+ * rom/crc.h - Host stub
+ */
+#ifndef __ROM_CRC_H__
+#define __ROM_CRC_H__
+
+#include <stdint.h>
+
+uint32_t crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len);
+
+#endif // __ROM_CRC_H__
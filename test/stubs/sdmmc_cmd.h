@@ -0,0 +1,11 @@
+/**
+ * sdmmc_cmd.h - Host stub
+ */
+#ifndef __SDMMC_CMD_H__
+#define __SDMMC_CMD_H__
+
+typedef struct {
+  int unused;
+} sdmmc_card_t;
+
+#endif // __SDMMC_CMD_H__
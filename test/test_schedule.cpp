@@ -0,0 +1,356 @@
+/**
+ * test_schedule.cpp - Unit tests of the capture schedule
+ *
+ * Copyright (c) 2019, David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * The schedule is evaluated in local time with mktime(). These tests cover
+ * the daylight saving time transitions of the Central European time zone, and
+ * windows that pass midnight.
+ *
+ * The result of mktime() for a local time that doesn't exist, or exists twice,
+ * differs between C libraries. For those cases only the properties that must
+ * hold with any C library are checked.
+ */
+#include "config.h"
+
+#include "Arduino.h"
+
+#include <time.h>
+#include <sys/time.h>
+
+#include "configuration.h"
+#include "schedule.h"
+
+// Maximum amount of fire times collected per test
+#define FIRE_TIMES_MAX 32
+
+#define TZ_CET "CET-1CEST,M3.5.0,M10.5.0/3"
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+static unsigned int failures = 0;
+
+/**
+ * Unix time of UTC date and time
+ */
+static time_t utc(int year, int mon, int mday, int hour, int min)
+{
+  struct tm tm = {};
+
+  tm.tm_year = year - 1900;
+  tm.tm_mon = mon - 1;
+  tm.tm_mday = mday;
+  tm.tm_hour = hour;
+  tm.tm_min = min;
+
+  return timegm(&tm);
+}
+
+static void set_config(const char *tz, const char *schedule)
+{
+  cfg.config_set("timezone", tz);
+  cfg.config_set("schedule", "");
+  cfg.config_set("schedule", schedule);
+
+  setenv("TZ", cfg.getTzInfo(), 1);
+  tzset();
+}
+
+/**
+ * Collect fire times of the schedule in [from, until)
+ *
+ * Walks the schedule like the capture loop does.
+ *
+ * @returns	Amount of fire times
+ */
+static unsigned int fire_times(time_t from, time_t until, time_t *times)
+{
+  struct timeval tv = { from, 0 };
+  unsigned int count = 0;
+
+  schedule_adjust(&tv);
+  while (tv.tv_sec < until && count < FIRE_TIMES_MAX) {
+    if (schedule_active(&tv)) {
+      times[count++] = tv.tv_sec;
+    }
+
+    struct timeval prev = tv;
+    schedule_next(&tv);
+    if (!timercmp(&prev, &tv, <)) {
+      printf("Schedule didn't advance at %ld\n", (long) prev.tv_sec);
+      failures++;
+      break;
+    }
+  }
+
+  return count;
+}
+
+/**
+ * Check fire times against expected local times
+ *
+ * @param expected	Local times as "YYYY-MM-DD HH:MM ZONE"
+ */
+static void check_times(const char *name, const time_t *times,
+                        unsigned int count, const char * const *expected,
+                        unsigned int expected_cnt)
+{
+  bool ok = (count == expected_cnt);
+
+  for (unsigned int i = 0; ok && i < count; i++) {
+    char buf[32];
+    struct tm tm;
+    localtime_r(&times[i], &tm);
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M %Z", &tm);
+    ok = (strcmp(buf, expected[i]) == 0);
+  }
+
+  if (!ok) {
+    printf("%s: unexpected fire times:\n", name);
+    for (unsigned int i = 0; i < count; i++) {
+      char buf[32];
+      struct tm tm;
+      localtime_r(&times[i], &tm);
+      strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M %Z", &tm);
+      printf("  %s\n", buf);
+    }
+    failures++;
+  }
+}
+
+#define CHECK_TIMES(times, count, ...) do { \
+    static const char * const expected[] = { __VA_ARGS__ }; \
+    check_times(__func__, times, count, expected, \
+                sizeof(expected) / sizeof(expected[0])); \
+  } while (0)
+
+/**
+ * Window over the spring-forward transition, 02:00 CET becomes 03:00 CEST
+ *
+ * The interval grid runs in real time from the window start, and the window
+ * is two hours long in real time.
+ */
+static void test_window_spring_forward()
+{
+  time_t times[FIRE_TIMES_MAX];
+
+  set_config(TZ_CET, "* 01:00-04:00 30m");
+  unsigned int count = fire_times(utc(2021, 3, 27, 12, 0),
+                                  utc(2021, 3, 28, 12, 0), times);
+
+  CHECK_TIMES(times, count,
+              "2021-03-28 01:00 CET",
+              "2021-03-28 01:30 CET",
+              "2021-03-28 03:00 CEST",
+              "2021-03-28 03:30 CEST");
+}
+
+/**
+ * Window over the fall-back transition, 03:00 CEST becomes 02:00 CET
+ *
+ * The repeated hour is captured twice, the window is four hours long in real
+ * time.
+ */
+static void test_window_fall_back()
+{
+  time_t times[FIRE_TIMES_MAX];
+
+  set_config(TZ_CET, "* 01:00-04:00 30m");
+  unsigned int count = fire_times(utc(2021, 10, 30, 12, 0),
+                                  utc(2021, 10, 31, 12, 0), times);
+
+  CHECK_TIMES(times, count,
+              "2021-10-31 01:00 CEST",
+              "2021-10-31 01:30 CEST",
+              "2021-10-31 02:00 CEST",
+              "2021-10-31 02:30 CEST",
+              "2021-10-31 02:00 CET",
+              "2021-10-31 02:30 CET",
+              "2021-10-31 03:00 CET",
+              "2021-10-31 03:30 CET");
+}
+
+/**
+ * Window that stays clear of the transition keeps its local times
+ */
+static void test_window_dst_days()
+{
+  time_t times[FIRE_TIMES_MAX];
+
+  set_config(TZ_CET, "* 12:00-13:00 1h");
+  unsigned int count = fire_times(utc(2021, 3, 27, 0, 0),
+                                  utc(2021, 3, 30, 0, 0), times);
+  CHECK_TIMES(times, count,
+              "2021-03-27 12:00 CET",
+              "2021-03-28 12:00 CEST",
+              "2021-03-29 12:00 CEST");
+
+  count = fire_times(utc(2021, 10, 30, 0, 0), utc(2021, 11, 2, 0, 0), times);
+  CHECK_TIMES(times, count,
+              "2021-10-30 12:00 CEST",
+              "2021-10-31 12:00 CET",
+              "2021-11-01 12:00 CET");
+}
+
+/**
+ * Once rule at a local time that doesn't exist
+ *
+ * Must fire exactly once, within an hour of the nominal time.
+ */
+static void test_once_nonexistent()
+{
+  time_t times[FIRE_TIMES_MAX];
+
+  set_config(TZ_CET, "2021-03-28 02:30");
+  unsigned int count = fire_times(utc(2021, 3, 27, 12, 0),
+                                  utc(2021, 3, 30, 0, 0), times);
+
+  CHECK(count == 1);
+  if (count == 1) {
+    // 02:30 CET is 01:30 UTC, 02:30 CEST is 00:30 UTC
+    CHECK(times[0] >= utc(2021, 3, 28, 0, 30));
+    CHECK(times[0] <= utc(2021, 3, 28, 1, 30));
+  }
+}
+
+/**
+ * Once rule at a local time that exists twice
+ *
+ * Must fire exactly once, at either of the two instances.
+ */
+static void test_once_repeated()
+{
+  time_t times[FIRE_TIMES_MAX];
+
+  set_config(TZ_CET, "2021-10-31 02:30");
+  unsigned int count = fire_times(utc(2021, 10, 30, 12, 0),
+                                  utc(2021, 11, 2, 0, 0), times);
+
+  CHECK(count == 1);
+  if (count == 1) {
+    CHECK(times[0] == utc(2021, 10, 31, 0, 30) ||
+          times[0] == utc(2021, 10, 31, 1, 30));
+  }
+
+  // Also when starting in between the two instances
+  count = fire_times(utc(2021, 10, 31, 0, 45), utc(2021, 11, 2, 0, 0), times);
+  CHECK(count <= 1);
+}
+
+/**
+ * Window that passes midnight continues on the next day
+ */
+static void test_window_midnight()
+{
+  time_t times[FIRE_TIMES_MAX];
+
+  // Friday 2021-06-04 to Saturday
+  set_config("GMT0", "fri 22:00-02:00 1h");
+  unsigned int count = fire_times(utc(2021, 6, 3, 0, 0),
+                                  utc(2021, 6, 12, 0, 0), times);
+  CHECK_TIMES(times, count,
+              "2021-06-04 22:00 GMT",
+              "2021-06-04 23:00 GMT",
+              "2021-06-05 00:00 GMT",
+              "2021-06-05 01:00 GMT",
+              "2021-06-11 22:00 GMT",
+              "2021-06-11 23:00 GMT");
+
+  // Starting after midnight uses the window of the day before
+  count = fire_times(utc(2021, 6, 5, 0, 30), utc(2021, 6, 5, 12, 0), times);
+  CHECK_TIMES(times, count,
+              "2021-06-05 01:00 GMT");
+
+  // Window ending at midnight
+  set_config("GMT0", "* 23:00-24:00 20m");
+  count = fire_times(utc(2021, 6, 4, 22, 0), utc(2021, 6, 5, 23, 10), times);
+  CHECK_TIMES(times, count,
+              "2021-06-04 23:00 GMT",
+              "2021-06-04 23:20 GMT",
+              "2021-06-04 23:40 GMT",
+              "2021-06-05 23:00 GMT");
+}
+
+/**
+ * Window that passes midnight and the spring-forward transition
+ */
+static void test_window_midnight_dst()
+{
+  time_t times[FIRE_TIMES_MAX];
+
+  set_config(TZ_CET, "sat 23:00-04:00 1h");
+  unsigned int count = fire_times(utc(2021, 3, 27, 12, 0),
+                                  utc(2021, 3, 28, 12, 0), times);
+  CHECK_TIMES(times, count,
+              "2021-03-27 23:00 CET",
+              "2021-03-28 00:00 CET",
+              "2021-03-28 01:00 CET",
+              "2021-03-28 03:00 CEST");
+}
+
+/**
+ * Interval units are range checked before scaling
+ */
+static void test_parse_interval()
+{
+  schedule_rule_t rule;
+
+  CHECK(schedule_parse_rule("* 08:00-18:00 24h", &rule));
+  CHECK(rule.interval == 24UL * 60 * 60 * 1000);
+  CHECK(schedule_parse_rule("* 08:00-18:00 1440m", &rule));
+  CHECK(schedule_parse_rule("* 08:00-18:00 86400s", &rule));
+  CHECK(!schedule_parse_rule("* 08:00-18:00 25h", &rule));
+  CHECK(!schedule_parse_rule("* 08:00-18:00 1441m", &rule));
+  CHECK(!schedule_parse_rule("* 08:00-18:00 86401s", &rule));
+  // Wraps to 3433104 ms with a 32-bit multiplication
+  CHECK(!schedule_parse_rule("* 08:00-18:00 1194h", &rule));
+  CHECK(!schedule_parse_rule("* 08:00-18:00 999ms", &rule));
+}
+
+int main()
+{
+  test_parse_interval();
+  test_window_spring_forward();
+  test_window_fall_back();
+  test_window_dst_days();
+  test_once_nonexistent();
+  test_once_repeated();
+  test_window_midnight();
+  test_window_midnight_dst();
+
+  if (failures != 0) {
+    printf("test_schedule: %u failures\n", failures);
+    return 1;
+  }
+
+  printf("test_schedule: OK\n");
+  return 0;
+}